@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "interval_status.h"
+
+#define WATCH_INTERVAL_NS 100000000LL  // Redraw the watch line ten times a second
+#define BENCH_SECONDS 1.0
+#define BENCH_MAX_THREADS 8
+
+typedef struct {
+    const IntervalStatus *status;
+    long reads;
+    long retries;
+    long torn;        // Snapshots that didn't match what the test writer wrote
+} BenchReader;
+
+// Global variables
+const IntervalStatus *status = NULL;
+const char *status_name = STATUS_SHM_NAME;  // As given to the timer's --status-name
+int bench_running = 1;
+int bench_writer = 0;   // The segment is ours, written by a test thread
+int running = 1;
+
+// Function prototypes
+const IntervalStatus *open_status();
+void print_status(const IntervalStatus *snapshot, const char *end);
+void watch_status();
+void bench_status();
+void *bench_reader_main(void *arg);
+void *bench_writer_main(void *arg);
+void print_usage(const char *program);
+void signal_handler(int sig);
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"watch", no_argument, NULL, 'w'},
+        {"bench", no_argument, NULL, 'b'},
+        {"name",  required_argument, NULL, 'n'},
+        {"help",  no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    int watch = 0;
+    int bench = 0;
+    while ((opt = getopt_long(argc, argv, "wbn:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                watch = 1;
+                break;
+            case 'b':
+                bench = 1;
+                break;
+            case 'n':
+                status_name = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (bench) {
+        bench_status();
+        return 0;
+    }
+
+    status = open_status();
+    if (!status) {
+        printf("No timer running\n");
+        return 1;
+    }
+
+    if (watch) {
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
+        watch_status();
+    } else {
+        IntervalStatus snapshot;
+        status_read(status, &snapshot);
+        print_status(&snapshot, "\n");
+    }
+    return 0;
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("Print the state of a running interval_timer.\n");
+    printf("Options:\n");
+    printf("  -w, --watch  Keep updating the status line\n");
+    printf("  -b, --bench  Measure snapshot reads per second and exit\n");
+    printf("  -n, --name NAME  Segment of the timer started with --status-name NAME\n");
+    printf("  -h, --help   Show this help\n");
+}
+
+void signal_handler(int sig) {
+    (void)sig; // Suppress unused parameter warning
+    running = 0;
+}
+
+const IntervalStatus *open_status() {
+    int fd = shm_open(status_name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    void *map = mmap(NULL, sizeof(IntervalStatus), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const IntervalStatus *shared = map;
+    if (shared->magic != STATUS_MAGIC || shared->version != STATUS_VERSION) {
+        printf("Warning: Status segment has an unknown layout\n");
+        munmap(map, sizeof(IntervalStatus));
+        return NULL;
+    }
+    return shared;
+}
+
+void print_status(const IntervalStatus *snapshot, const char *end) {
+    static const char *phases[] = { "idle", "running", "paused", "boundary", "finished" };
+    const char *phase = snapshot->phase >= 0 && snapshot->phase <= STATUS_FINISHED ? phases[snapshot->phase] : "?";
+    if (snapshot->phase == STATUS_IDLE || snapshot->phase == STATUS_FINISHED) {
+        printf("%-8s%s", phase, end);
+        return;
+    }
+
+    // Remaining time is worked out here, so the timer never has to write per tick
+    int64_t remaining = status_remaining_ns(snapshot, status_clock_ns());
+    int64_t done = snapshot->elapsed_before_ns + snapshot->interval_ns - remaining;
+    double progress = snapshot->session_ns > 0 ? 100.0 * done / snapshot->session_ns : 0.0;
+    int tenths = (int)((remaining + 99999999) / 100000000);
+    printf("%-8s %d/%d %-16s %02d:%02d.%d  %5.1f%%  next: %s%s", phase,
+           snapshot->interval + 1, snapshot->interval_count, snapshot->label,
+           tenths / 600, tenths / 10 % 60, tenths % 10, progress,
+           snapshot->next_label[0] ? snapshot->next_label : "-", end);
+}
+
+void watch_status() {
+    IntervalStatus snapshot;
+    while (running) {
+        status_read(status, &snapshot);
+        print_status(&snapshot, "\033[K\r");
+        fflush(stdout);
+        if (snapshot.phase == STATUS_FINISHED) break;
+
+        struct timespec ts = { 0, WATCH_INTERVAL_NS };
+        nanosleep(&ts, NULL);
+    }
+    printf("\n");
+}
+
+void bench_status() {
+    // Against the live segment if there is one; otherwise against a private
+    // one rewritten nonstop, the worst case for readers
+    status = open_status();
+    pthread_t writer;
+    if (!status) {
+        void *map = mmap(NULL, sizeof(IntervalStatus), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            printf("Error: Cannot map test segment: %s\n", strerror(errno));
+            return;
+        }
+        status = map;
+        bench_writer = 1;
+        pthread_create(&writer, NULL, bench_writer_main, map);
+        printf("No timer running, benchmarking against a writer updating continuously\n");
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int threads = 1; threads <= BENCH_MAX_THREADS && threads <= cpus; threads *= 2) {
+        pthread_t thread[BENCH_MAX_THREADS];
+        BenchReader reader[BENCH_MAX_THREADS];
+        __atomic_store_n(&bench_running, 1, __ATOMIC_RELEASE);
+        for (int i = 0; i < threads; i++) {
+            memset(&reader[i], 0, sizeof(reader[i]));
+            reader[i].status = status;
+            pthread_create(&thread[i], NULL, bench_reader_main, &reader[i]);
+        }
+
+        struct timespec ts = { (time_t)BENCH_SECONDS, (long)((BENCH_SECONDS - (time_t)BENCH_SECONDS) * 1e9) };
+        nanosleep(&ts, NULL);
+        __atomic_store_n(&bench_running, 0, __ATOMIC_RELEASE);
+
+        long reads = 0, retries = 0, torn = 0;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(thread[i], NULL);
+            reads += reader[i].reads;
+            retries += reader[i].retries;
+            torn += reader[i].torn;
+        }
+        printf("%d reader%s: %8.1f M reads/s, %ld retries, %ld torn\n", threads, threads == 1 ? " " : "s",
+               reads / BENCH_SECONDS / 1e6, retries, torn);
+    }
+
+    if (bench_writer) {
+        bench_writer = 0;
+        pthread_join(writer, NULL);
+    }
+}
+
+void *bench_reader_main(void *arg) {
+    BenchReader *reader = arg;
+    IntervalStatus snapshot;
+    while (__atomic_load_n(&bench_running, __ATOMIC_ACQUIRE)) {
+        reader->retries += status_read(reader->status, &snapshot);
+        reader->reads++;
+
+        // The test writer keeps every field equal to the sequence
+        if (bench_writer && (snapshot.interval_end_ns != (int64_t)snapshot.sequence ||
+                             snapshot.updated_ns != (int64_t)snapshot.sequence)) {
+            reader->torn++;
+        }
+    }
+    return NULL;
+}
+
+void *bench_writer_main(void *arg) {
+    IntervalStatus *shared = arg;
+    shared->magic = STATUS_MAGIC;
+    shared->version = STATUS_VERSION;
+    uint64_t sequence = 0;
+    while (__atomic_load_n(&bench_writer, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        shared->interval_end_ns = sequence + 2;
+        shared->updated_ns = sequence + 2;
+        sequence += 2;
+        __atomic_store_n(&shared->sequence, sequence, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
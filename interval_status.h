@@ -0,0 +1,67 @@
+// Live status shared by interval_timer with local readers (dashboards,
+// signage) through POSIX shared memory. The timer writes it only when its
+// state changes; readers work out the remaining time themselves from the
+// monotonic clock, so they can poll as often as they like.
+#ifndef INTERVAL_STATUS_H
+#define INTERVAL_STATUS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define STATUS_SHM_NAME "/interval_timer_status"
+#define STATUS_MAGIC 0x49545354  // "ITST"
+#define STATUS_VERSION 1
+#define STATUS_LABEL_LENGTH 64
+
+enum { STATUS_IDLE, STATUS_RUNNING, STATUS_PAUSED, STATUS_BOUNDARY, STATUS_FINISHED };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence;         // Seqlock: odd while the timer is writing
+    int32_t phase;
+    int32_t interval;          // Index of the current interval
+    int32_t interval_count;
+    int32_t pid;               // Timer process, for readers to check it's alive
+    char label[STATUS_LABEL_LENGTH];
+    char next_label[STATUS_LABEL_LENGTH];  // Empty on the last interval
+    int64_t interval_end_ns;   // CLOCK_MONOTONIC time the interval runs out
+    int64_t interval_ns;       // Its full length
+    int64_t paused_at_ns;      // Where the clock stands while paused
+    int64_t elapsed_before_ns; // Program time before this interval
+    int64_t session_ns;        // Length of the whole program
+    int64_t updated_ns;        // When this was written
+} IntervalStatus;
+
+static inline int64_t status_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Copy a consistent snapshot out of the shared segment. Never blocks the
+// writer; retries while a write is in progress or one happened during the
+// copy. Returns the number of retries.
+static inline int status_read(const IntervalStatus *shared, IntervalStatus *copy) {
+    int retries = 0;
+    while (1) {
+        uint64_t before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if ((before & 1) == 0) {
+            memcpy(copy, (const void *)shared, sizeof(*copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == before) {
+                return retries;
+            }
+        }
+        retries++;
+    }
+}
+
+static inline int64_t status_remaining_ns(const IntervalStatus *status, int64_t now) {
+    if (status->phase == STATUS_PAUSED) now = status->paused_at_ns;
+    int64_t remaining = status->interval_end_ns - now;
+    return remaining > 0 ? remaining : 0;
+}
+
+#endif
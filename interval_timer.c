@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
 #include <signal.h>
@@ -11,7 +12,29 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <math.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
@@ -21,34 +44,635 @@
 #include <cairo/cairo.h>
 #include <cairo/cairo-xlib.h>
 #include <alsa/asoundlib.h>
+#include "interval_status.h"
 
-#define MAX_INTERVALS 100
+#define MAX_INTERVALS 4096
 #define MAX_LABEL_LENGTH 50
 #define SOUND_DEVICE "default"
+#define AUDIO_PERIODS 4
+#define AUDIO_MIN_PERIOD_US 2000     // Smallest period tried before the device limit
+#define AUDIO_MAX_PERIOD_FRAMES 8192 // Largest period underruns can push us to
+#define AUDIO_MAX_VOICES 32
+#define MAX_COUNTDOWN_PIPS 20        // Leaves voices for the beeps, the prompt and clicks
+#define AUDIO_WAKE_AHEAD_NS 300000000LL // Start streaming this long before a cue is due
+#define TAG_BEEP 1
+#define TAG_COUNTDOWN 2
+#define TAG_PROMPT 3
+#define TAG_CADENCE 4
+#define MAX_CUES 32
+#define MAX_PATH_LENGTH 4096
+#define PCM_CACHE_MAGIC "ITPCM001"
+#define BEEP_SPACING_NS 400000000LL // 0.3s beep plus 100ms pause
+#define BEEP_BURST_NS (4 * BEEP_SPACING_NS + 300000000LL)
+#define FINAL_PIP_GAP_NS 350000000LL // Burst starts after the final countdown pip
+#define LIMITER_RELEASE_NS 100000000LL // Time for the limiter gain to recover
+#define BENCH_PERIOD_FRAMES 256
+#define MUSIC_READ_FRAMES 4096          // Source frames read from disk at a time
+#define MUSIC_PERIOD_US 20000           // Default period with music, which keeps the stream running
+#define MUSIC_DUCK_LEVEL 0.3f           // Music level under a cue, relative to normal
+#define MUSIC_DUCK_LEAD_NS 50000000LL   // Start ducking this long before a cue
+#define MUSIC_ATTACK_NS 30000000LL      // Time constant of the duck going down
+#define MUSIC_RELEASE_NS 400000000LL    // and of coming back up
+#define BENCH_SECONDS 0.25
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+#define LOW_POWER_TIMER_SLACK_NS 50000000 // 50ms, well below one displayed second
+#define AUDIO_RT_PRIORITY 20         // SCHED_FIFO priorities in --realtime mode
+#define TIMER_RT_PRIORITY 10
+#define REALTIME_STACK_BYTES (512 * 1024)   // Thread stacks, all locked in memory
+#define REALTIME_PREFAULT_BYTES (256 * 1024) // Main thread stack touched up front
+#define START_AT_LEAD_NS (100 * NSEC_PER_MSEC) // Last part of the wait for --start-at, on the wall clock
 
 typedef struct {
     char label[MAX_LABEL_LENGTH];
-    int duration;  // in seconds
+    int duration_ms;  // in milliseconds
+    int bpm;       // Click track tempo, 0 for none
 } Interval;
 
 typedef struct {
     Interval intervals[MAX_INTERVALS];
     int count;
+    int64_t tree[MAX_INTERVALS + 1];  // Fenwick tree over the durations in ns, 1-based
+    int64_t total_ns;                 // Length of the whole program
+    int version;                      // Bumped by every edit
 } IntervalSet;
 
+// Input decoded into commands, queued in arrival order so a burst of keys
+// is handled in full and nothing waits for the next wakeup
+#define INPUT_QUEUE_SIZE 64
+enum { CMD_NONE, CMD_SKIP, CMD_QUIT, CMD_PAUSE, CMD_SCRUB, CMD_PREVIOUS, CMD_JUMP,
+       CMD_ADJUST, CMD_INSERT_REST, CMD_LOAD, CMD_SYNC, CMD_SYNC_STEP };
+#define ADJUST_STEP_MS 10000    // '+' and '-' lengthen or shorten the interval by this
+#define INSERT_REST_MS 30000    // Length of a rest inserted with 'R'
+#define SCRUB_STEP_NS (10 * NSEC_PER_SEC)  // Left and right arrows move this far
+#define REWIND_GRACE_NS (3 * NSEC_PER_SEC) // Going back this early restarts the previous interval
+
+typedef struct {
+    int command;
+    int64_t arg;      // Scrub distance, interval to jump to, milliseconds to add, or sync error
+    int64_t time_ns;  // When the input happened, on the monotonic clock
+} InputEvent;
+
+typedef struct {
+    InputEvent events[INPUT_QUEUE_SIZE];
+    int head;  // Next event to hand out
+    int count;
+} InputQueue;
+
+// Latencies in power-of-two buckets from LATENCY_BASE_US up, last one open-ended
+#define LATENCY_BUCKETS 16
+#define LATENCY_BASE_US 250.0
+
+typedef struct {
+    long count;
+    long buckets[LATENCY_BUCKETS];  // Bucket i counts latencies below LATENCY_BASE_US << i
+    double sum_us;
+    double max_us;
+} LatencyHistogram;
+
+typedef struct {
+    int64_t start_ns;       // Monotonic time the session started
+    long wakeups;           // Returns from blocking waits in the main loop
+    long render_wakeups;    // and in the render thread
+    long frames_drawn;
+    long frames_skipped;    // Redraws avoided because nothing visible changed
+    long audio_underruns;
+    long voices_dropped;    // Cues not played because every voice was in use
+    long music_dropouts;    // Periods where the disk hadn't kept up with the music
+    long timer_waits;           // Timed waits that ran to their deadline
+    double timer_late_sum_us;   // How long after the deadline they returned
+    double timer_late_max_us;
+    long audio_periods;         // Consecutive periods of a running stream
+    double audio_jitter_sum_us; // Deviation of their spacing from the period
+    double audio_jitter_max_us;
+    long onset_count;       // Scheduled cues whose onset was measured
+    double onset_error_sum_us;  // Sum of absolute onset errors
+    double onset_error_max_us;
+    long av_count;              // Cues whose flash and sound were both measured
+    double av_offset_sum_us;    // Flash time minus audible onset, signed
+    double av_offset_max_us;    // Largest absolute offset
+    LatencyHistogram key_delivery;   // X server timestamp to our reading the key
+    LatencyHistogram input_to_flush; // Key press to the first frame that shows it
+    int64_t key_clock_offset;        // Smallest monotonic minus server time seen
+    int key_clock_calibrated;        // key_clock_offset holds a sample
+    long input_dropped;              // Commands lost to a full input queue
+    long pauses;
+    int64_t paused_ns;               // Time spent paused, not counted as training
+    long sync_rounds;                // Round trips to the sync leader
+    long sync_slews;                 // Small corrections onto its schedule
+    long sync_steps;                 // and seeks to catch up with it
+    double sync_error_max_us;        // Largest error once the filter had settled
+    int64_t start_error_ns;          // How far from the --start-at time we started
+} SessionStats;
+
+// Pre-generated sounds, so nothing is synthesized while a cue is due
+enum { CUE_BEEP, CUE_PIP, CUE_FINAL_PIP, CUE_CLICK, CUE_COUNT };
+
+typedef struct {
+    short *samples;
+    int frames;
+    void *map;            // Cache file the samples are mapped from, if any
+    size_t map_size;
+    float gain;           // Level the cue is mixed at, 1.0 for full scale
+} Cue;
+
+// Sample layout of a WAV file
+typedef struct {
+    int format;           // 1 for integer PCM, 3 for float
+    int channels;
+    int bits;
+    unsigned int rate;
+} WavFormat;
+
+// Header of a decoded sample in the on-disk cache; mono S16 frames follow
+typedef struct {
+    char magic[8];
+    uint32_t rate;
+    uint32_t frames;
+    int64_t source_size;  // Source file size and mtime, to notice edits
+    int64_t source_mtime;
+} PcmCacheHeader;
+
+// A cue scheduled to start at a monotonic time
+typedef struct {
+    int active;
+    const Cue *cue;
+    int64_t target_ns;    // When the first sample should be heard
+    int64_t start_frame;  // Stream position of the first sample, -1 until placed
+    int tag;
+    int sync;             // Visual cues are lined up with this voice
+    int measured;         // Onset error has been recorded
+} Voice;
+
+// Streams mixed voices to the device from its own thread. The stream only
+// runs while a cue is playing or due soon, so an idle timer causes no wakeups.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int started;
+    int running;
+    int stream_active;
+    int64_t written_frames;  // Stream position of the next frame to be written
+    int64_t output_delay_ns; // Device delay at the last period, 0 while stopped
+    int64_t sync_onset_ns;   // Measured onset of the latest sync voice
+    int stream_underruns;    // Underruns since the stream last started
+    Voice voices[AUDIO_MAX_VOICES];
+    Cue cues[MAX_CUES];      // Built-in cues first, then sound pack prompts
+    char cue_labels[MAX_CUES][MAX_LABEL_LENGTH]; // Interval label a prompt plays for
+    int cue_count;
+    int beep_is_sample;      // Boundary sound comes from a sound pack
+    int paused;              // Session paused: music holds and the stream stops
+
+    // Click track for the current interval. Beat times are worked out from
+    // the start each time rather than accumulated, so they never drift.
+    int cadence_bpm;         // 0 while no click track is running
+    int64_t cadence_start_ns;
+    int64_t cadence_end_ns;
+    int64_t cadence_next;    // Beat number of the next click to schedule
+
+    // Negotiated with the device, so nothing is resampled on the way out
+    unsigned int rate;
+    unsigned int channels;
+    snd_pcm_format_t format;
+    int period_frames;
+    int buffer_frames;
+    int period_target;       // Requested period, raised after underruns
+    float *mix;              // One period mixed in mono, full scale at 1.0
+    float limiter_gain;      // 1.0 unless a recent period would have clipped
+    void *output;            // The same period in the device format
+} AudioEngine;
+
+// Streams a playlist through the mixer under the cues. A reader thread
+// decodes each track into one block while the audio thread plays the other.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int started;
+    int running;
+    int playing;             // Audio thread keeps the stream open for the music
+    char **tracks;
+    int track_count;
+    int track;               // Track currently being read
+
+    // Reader thread only
+    FILE *file;
+    WavFormat wav;
+    long data_left;          // Bytes of samples left in the current track
+    unsigned char *raw;      // Undecoded frames as read from disk
+    int raw_frames;
+    int raw_pos;
+    double step;             // Source frames per device frame
+    double phase;            // Position between the two source samples
+    float previous;
+    float next;
+
+    // Blocks at the device rate, filled and played strictly in turn
+    short *blocks[2];
+    int block_frames;
+    int ready[2];
+    int fill_block;          // Reader thread only
+    int play_block;          // Audio thread only
+    int play_pos;
+    float gain;              // Audio thread only, follows the duck smoothly
+} MusicPlayer;
+
+// One way of mixing voices into a period and limiting the result. The best
+// one the CPU supports is picked at startup; the others stay for --bench-mix.
+typedef struct {
+    const char *name;
+    void (*mix)(float *mix, const short *samples, int count, float gain);
+    float (*peak)(const float *mix, int count);  // Largest absolute sample
+    int supported;
+} Mixer;
+
+enum { MIXER_SCALAR, MIXER_SSE2, MIXER_AVX2, MIXER_COUNT };
+
+#define FLASH_STEP_NS 200000000LL  // Each white or red step of the boundary flash
+#define FLASH_STEPS 6
+#define SNAPSHOT_FRESH 4           // Set on the middle slot until the renderer takes it
+
+// What the screen should show, published by the timer thread. The render
+// thread works out the clock and bars from these and the monotonic clock,
+// so it never has to ask the timer thread anything.
+enum { PHASE_RUNNING, PHASE_PAUSED, PHASE_FLASH, PHASE_COMPLETE, PHASE_DONE, PHASE_WAITING };
+
+typedef struct {
+    uint64_t sequence;         // Changes with every published state
+    int phase;
+    int interval;              // Index into interval_set
+    int64_t interval_end_ns;   // Monotonic time the interval runs out
+    int64_t interval_ns;
+    int64_t elapsed_before_ns; // Training time before this interval
+    int64_t session_ns;        // Length of the whole program
+    int program_version;       // interval_set.version this was published against
+    int64_t flash_ns;          // When the boundary flash should be seen, 0 for now
+    int64_t input_ns;          // Key press that led to this state, 0 if none
+    int64_t paused_at_ns;      // Where the clock stands still while paused
+} FrameState;
+
+// Snapshots pass through three slots, so the timer thread can always
+// publish and the render thread can always read without either waiting
+typedef struct {
+    pthread_t thread;
+    int started;
+    int wake_fd;               // eventfd poked after each publish
+    FrameState slots[3];
+    int write_slot;            // Timer thread only
+    int read_slot;             // Render thread only
+    int middle;                // Latest published slot, plus SNAPSHOT_FRESH
+    int invalid;               // Window contents were lost, repaint everything
+    uint64_t sequence;         // Timer thread only
+} Renderer;
+
+// Where the session stands, in a small file mapped into memory so every
+// tick is a plain store; the kernel writes it back, and a killed process
+// loses nothing. Two slots are written in turn, so a write cut short
+// leaves the other one intact.
+#define CHECKPOINT_MAGIC 0x49544350          // "ITCP"
+#define CHECKPOINT_SYNC_NS (5 * NSEC_PER_SEC) // Ask for writeback at most this often
+#define CHECKPOINT_MAX_EDITS 256             // Live edits a resume can replay
+
+typedef struct {
+    uint64_t sequence;   // Higher is newer, 0 for never written
+    uint64_t program;    // program_id of the intervals it belongs to
+    int32_t interval;
+    int32_t finished;    // Session ran to the end, nothing to resume
+    int64_t offset_ns;   // How far into the interval
+    uint32_t edits;      // Entries of the edit log that apply, past the limit if some didn't fit
+    uint32_t unused;
+    uint64_t check;      // Hash of everything above, to spot a torn write
+} CheckpointSlot;
+
+// Live edits, in the order they were made, so a resume can make them again
+// on the file as loaded. An entry is written before any slot counts it.
+typedef struct {
+    uint64_t program;    // program_id of the file it was made on
+    int32_t command;     // CMD_ADJUST or CMD_INSERT_REST
+    int32_t interval;    // Interval adjusted, or where the rest went in
+    int32_t duration_ms; // Duration the interval was given
+    int32_t unused;
+    uint64_t check;
+} CheckpointEdit;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;       // sizeof(CheckpointFile), so a layout change starts afresh
+    CheckpointSlot slots[2];
+    CheckpointEdit edits[CHECKPOINT_MAX_EDITS];
+} CheckpointFile;
+
+// Session history: an append-only log of fixed-size records, one per
+// interval left and one per session, written by its own thread in batches
+#define HISTORY_MAGIC 0x48495354        // "HIST"
+#define HISTORY_INDEX_MAGIC 0x48494458  // "HIDX"
+#define HISTORY_LABEL_LENGTH 32
+#define HISTORY_QUEUE_SIZE 64
+#define HISTORY_BATCH 16                // Records gathered before a write is forced
+#define HISTORY_FLUSH_NS (10 * NSEC_PER_SEC) // Longest a record waits otherwise
+enum { HISTORY_INTERVAL = 1, HISTORY_SESSION = 2 };
+#define HISTORY_SKIPPED 1   // Interval was skipped
+#define HISTORY_SEEKED 2    // Interval was left by seeking
+#define HISTORY_QUIT 4      // Session, or the interval, ended by quitting
+#define HISTORY_RESUMED 8   // Session was started with --resume
+
+typedef struct {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t flags;
+    int64_t session;     // Wall-clock start of the session, groups its records
+    int64_t time;        // Wall-clock time of the record
+    int32_t index;       // Interval number, or intervals completed for a session
+    int32_t planned_ms;
+    int32_t actual_ms;   // Time spent running, pauses excluded
+    int32_t paused_ms;
+    char label[HISTORY_LABEL_LENGTH];
+    uint32_t reserved;
+    uint32_t check;      // Low half of the FNV-1a of everything above
+} HistoryRecord;
+
+typedef struct {
+    pthread_t thread;
+    int started;
+    int running;
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    HistoryRecord queue[HISTORY_QUEUE_SIZE];
+    int count;
+    int64_t session;
+    long dropped;        // Records lost to a full queue
+} HistoryLog;
+
+// Control socket: line commands in, replies and subscribed events out.
+// Served from the timer thread's own poll, with bounded buffers so a slow
+// client is dropped rather than ever holding up the clock.
+#define CONTROL_MAX_CLIENTS 32
+#define CONTROL_BUFFER_SIZE 4096
+
+typedef struct {
+    int fd;              // -1 for a free slot
+    uint64_t id;         // Connection number, never reused like a slot or fd
+    int subscribed;
+    char in[CONTROL_BUFFER_SIZE];   // Partial command line
+    int in_len;
+    char out[CONTROL_BUFFER_SIZE];  // Replies and events not yet sent
+    int out_len;
+} ControlClient;
+
+typedef struct {
+    int started;
+    int fd;
+    ControlClient clients[CONTROL_MAX_CLIENTS];
+    long dropped;        // Clients refused or cut off
+    int phase;           // Last published state, for status and events
+    int interval;
+    int program_version;
+    int64_t interval_end_ns;
+    int64_t paused_at_ns;
+    int pause_wanted;    // Pause state asked for but not yet published, -1 for none
+    uint64_t next_id;    // Handed to the next client accepted, from 1
+    uint64_t load_client; // id of the client waiting to hear how its "start FILE" went, 0 for none
+} ControlServer;
+
+// Metrics for scraping in Prometheus text format. Each thread bumps its own
+// cache-line-aligned block without locks; the blocks are only added up when
+// a scrape comes in.
+#define METRIC_BUCKETS 16
+#define METRIC_BASE_NS 50000LL        // Bucket i holds values up to METRIC_BASE_NS << i
+#define METRICS_MAX_CONNECTIONS 4
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_TIMEOUT_NS (5 * NSEC_PER_SEC)  // Longest a scrape may hold a slot
+
+enum { THREAD_TIMER, THREAD_RENDER, THREAD_AUDIO, THREAD_MUSIC, METRIC_THREADS };
+
+typedef struct {
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t count;
+} MetricHistogram;
+
+typedef struct {
+    uint64_t wakeups;
+    uint64_t frames_drawn;
+    uint64_t audio_underruns;
+    uint64_t pcm_recoveries;
+    uint64_t music_dropouts;
+    uint64_t intervals_completed;
+    uint64_t sessions_completed;
+    MetricHistogram frame_render;   // Drawing a frame through to the flush
+    MetricHistogram x_flush;
+    MetricHistogram tick_lateness;  // Timed waits returning after their deadline
+} __attribute__((aligned(64))) ThreadMetrics;
+
+typedef struct {
+    int fd;              // -1 for a free slot
+    char request[METRICS_REQUEST_SIZE];
+    int len;
+    int64_t deadline_ns;  // Closed at this point, finished or not
+    char *response;       // Whole reply once the request is in, NULL before
+    size_t response_len;
+    size_t sent;
+} MetricsConnection;
+
+typedef struct {
+    int started;
+    int fd;
+    int is_unix;
+    MetricsConnection connections[METRICS_MAX_CONNECTIONS];
+} MetricsServer;
+
+// Clock sync between instances in different rooms. The leader answers
+// timestamped UDP requests with where it is in the program; followers
+// filter the round trips like NTP and slew their schedule onto its.
+#define SYNC_MAGIC 0x49545359                   // "ITSY"
+#define SYNC_SAMPLES 8                          // Round trips the filter picks from
+#define SYNC_POLL_NS (500 * NSEC_PER_MSEC)
+#define SYNC_FAST_POLL_NS (50 * NSEC_PER_MSEC)  // Until the window is full
+#define SYNC_STEP_NS (50 * NSEC_PER_MSEC)       // Further off than this, seek instead
+#define SYNC_SLEW_NS (2 * NSEC_PER_MSEC)        // Most the schedule moves per round trip
+#define SYNC_DEADBAND_NS 200000LL               // Close enough to leave alone
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    int64_t t1;          // Follower's clock when it asked
+    int64_t t2;          // Leader's clock when the request came in
+    int64_t t3;          // and when it answered
+    int64_t elapsed_ns;  // Leader's program position at t3
+    uint64_t program;    // Leader's program_id
+    int32_t phase;
+    int32_t unused;
+} SyncPacket;
+
+typedef struct {
+    int64_t offset_ns;   // Leader's clock minus ours
+    int64_t delay_ns;    // Round trip less the leader's turnaround
+} SyncSample;
+
+typedef struct {
+    int started;
+    int leader;
+    int fd;
+    uint32_t sequence;   // Last request sent; older replies are ignored
+    int64_t next_poll_ns;
+    SyncSample window[SYNC_SAMPLES];
+    long samples;
+    int64_t offset_ns;   // From the best sample in the window
+    int64_t delay_ns;
+    int64_t error_ns;    // Our position minus the leader's, last measured
+    int warned;
+    int phase;           // Last published state, to work out our position
+    int64_t elapsed_before_ns;
+    int64_t interval_ns;
+    int64_t interval_end_ns;
+    int64_t paused_at_ns;
+} ClockSync;
+
+// Columnar index over the log for --history, extended with whatever was
+// appended since it was saved. Each column is one field of every record.
+typedef struct {
+    uint32_t magic;
+    uint32_t labels;
+    uint64_t records;    // Log records folded in
+    uint64_t rows;       // Interval rows
+    uint64_t sessions;   // Session rows
+} HistoryIndexHeader;
+
+typedef struct {
+    uint64_t records;
+    uint32_t labels;
+    char (*label)[HISTORY_LABEL_LENGTH];
+    uint32_t *label_slot;   // Open-addressed by label hash, id + 1 or 0 for empty; not saved
+    uint32_t label_slots;   // Power of two, kept over twice the labels
+    size_t rows, row_capacity;
+    int32_t *week;       // Monday-based weeks since 1970, local time
+    int32_t *actual_ms;
+    uint16_t *label_id;
+    uint8_t *flags;
+    size_t sessions, session_capacity;
+    int32_t *session_week;
+} HistoryIndex;
+
+// Progress through the boundary flash on the render thread
+typedef struct {
+    int64_t start;  // First flash frame, 0 while not flashing
+    int step;       // Colour step last drawn, -1 for none
+    int settled;    // Last frame drawn had finished blending
+} FlashState;
+
+#define GLYPH_CHARS "0123456789:."
+#define GLYPH_COUNT 12
+#define TIMER_FONT_SIZE 300
+
+// Banner across the interval screen
+enum { BANNER_NONE, BANNER_PAUSED, BANNER_WAITING };
+
+// Pre-rendered clock characters, so a frame never rasterizes text
+typedef struct {
+    int valid;
+    cairo_surface_t *glyph[GLYPH_COUNT];
+    int width[GLYPH_COUNT];   // Cell width; all digits share one so text never shifts
+    int height;
+    int ascent;
+} GlyphCache;
+
+// Static parts of the current screen plus what the dynamic parts look like now
+typedef struct {
+    int valid;
+    int interval;             // Interval the layout was built for
+    int show_next;            // Whether the "Next:" preview is part of it
+    int banner;               // Which banner, if any, is part of it
+    int base_valid;
+    int program_version;      // Program the ticks and labels were drawn for
+    cairo_surface_t *base;        // Session-wide layer: title, bar backgrounds and ticks
+    cairo_surface_t *background;  // Full screen without clock digits or bar fills
+    cairo_surface_t *bars_filled; // Bar band with both bars completely filled
+    int band_y, band_height;
+    int bar_x, bar_width, bar_height;
+    int overall_y, current_y;
+    int timer_top;
+    char drawn_time[16];      // Clock text currently on screen
+    int overall_fill;         // Bar fill widths currently on screen, in pixels
+    int current_fill;
+} RenderCache;
+
+// The parts of the program a frame shows, copied under program_lock so
+// that drawing, flushing and checkpointing never hold it
+typedef struct {
+    int valid;
+    int version;              // program_version of the state it was copied for
+    int interval;             // Interval the labels belong to
+    int count;
+    int64_t total_ns;
+    uint64_t id;              // program_id, for checkpoints
+    uint32_t edits;           // program_edits, for checkpoints
+    char label[MAX_LABEL_LENGTH];
+    char next_label[MAX_LABEL_LENGTH];  // Empty on the last interval
+    int64_t ticks_ns[MAX_INTERVALS];    // Start of every interval
+} ProgramView;
+
 // Global variables
 IntervalSet interval_set;
+uint64_t program_id = 0;  // Hash of the intervals as loaded
+uint32_t program_edits = 0;  // Live edits made since, kept in the checkpoint's edit log
 int current_interval = 0;
-int time_remaining = 0;
-int total_training_time = 0;  // Total duration of all intervals
-int elapsed_training_time = 0; // Time elapsed in training
-Display *display = NULL;
+pthread_mutex_t program_lock = PTHREAD_MUTEX_INITIALIZER;  // Held by the renderer while it copies from interval_set, and for edits
+Display *display = NULL;         // Input and window management, timer thread
+Display *render_display = NULL;  // Drawing, render thread
 Window window;
 cairo_surface_t *surface = NULL;
 cairo_t *cr = NULL;
+Renderer renderer;
+InputQueue input_queue;
+Atom wm_protocols;        // Interned once at startup, so input handling never
+Atom wm_delete_window;    // goes back to the server
 snd_pcm_t *audio_handle = NULL;
+AudioEngine audio_engine;
+const char *sound_pack_file = NULL;  // Sound pack config, if any
+int audio_period_us = 0;  // Requested audio period, 0 for the smallest stable one
+int countdown_pips = 0;  // Pips before the end of each interval, plus one on the boundary
+int64_t flash_lead_ns = 0;  // How long a flash frame takes to reach the screen, render thread
+float master_volume = 1.0f;  // Applied to every cue on top of its own gain
+const char *music_file = NULL;  // WAV file or playlist to play under the cues
+float music_volume = 0.5f;
+const char *checkpoint_file = NULL;  // Defaults to ~/.interval_timer_checkpoint
+CheckpointFile *checkpoint = NULL;   // Written by the render thread once the session runs
+int checkpoint_fd = -1;              // Kept open for its lock, so one timer owns the file
+uint64_t checkpoint_sequence = 0;
+int64_t checkpoint_synced_ns = 0;
+int resume = 0;      // Start from the checkpoint
+int64_t start_at_ns = 0;  // CLOCK_REALTIME time to start at, 0 for straight away
+char start_at_text[32];   // The same as shown on screen
+const char *history_file = NULL;  // Defaults to ~/.interval_timer_history
+HistoryLog history;
+IntervalStatus *status_export = NULL;  // Shared memory for local status readers, timer thread
+const char *status_name = STATUS_SHM_NAME;  // Segment name, one per timer on the host
+const char *control_path = NULL;  // UNIX socket for console software, if any
+ControlServer control;
+char control_program[512];        // Program a client asked to start
+const char *metrics_address = NULL; // Loopback port or socket path for scrapes
+MetricsServer metrics_server;
+ThreadMetrics thread_metrics[METRIC_THREADS];
+const char *sync_address = NULL;  // Port to lead on, or the leader's HOST:PORT
+ClockSync clock_sync;
+MusicPlayer music;
+Mixer mixers[MIXER_COUNT];
+const Mixer *mixer = NULL;  // Fastest supported entry of mixers
 int running = 1;
 int screen_width, screen_height;
+int low_power = 0;   // Coalesce wakeups with timer slack and leave DPMS alone
+int realtime = 0;    // SCHED_FIFO timer and audio threads, memory locked
+int show_stats = 0;  // Print session statistics on exit
+SessionStats stats;
+int display_precision = 0;      // Digits shown after the seconds (0, 1 or 2)
+double refresh_rate = 60.0;     // Monitor refresh rate in Hz, from XRandR when available
+int animate = 0;                // Interpolate bars every frame and blend flash colours
+int fade_ms = 150;              // Duration of each flash colour blend when animating
+GlyphCache glyph_cache;
+RenderCache render_cache;
+ProgramView program_view;  // Render thread only
 
 // Function prototypes
 void setup_x11_window();
@@ -56,25 +680,311 @@ void cleanup_x11();
 void prevent_screen_sleep();
 void allow_screen_sleep();
 void setup_audio();
+int negotiate_audio(unsigned int rate);
+void build_cue_bank();
+void print_audio_config(const char *prefix);
+void load_sound_pack(const char *filename);
+int load_sample_cue(Cue *cue, const char *path);
+float *decode_wav(const char *path, unsigned int *rate, int *frames);
+int parse_wav_format(WavFormat *wav, const unsigned char *chunk, long chunk_size);
+double wav_sample(const WavFormat *wav, const unsigned char *p);
+short *resample_to_s16(const float *input, int input_frames, unsigned int input_rate,
+                       unsigned int output_rate, int *output_frames);
+int map_pcm_cache(Cue *cue, const char *cache_path, const struct stat *source);
+int pcm_cache_path(char *buf, size_t size, const char *source_path, const struct stat *source);
+void free_cue(Cue *cue);
+void play_prompt(const char *label);
+int64_t beep_burst_ns();
 void cleanup_audio();
 void reset_audio();
-void play_beep();
-void draw_timer(int minutes, int seconds, const char *label, int time_remaining);
+int64_t play_beep(int64_t start_ns, int sync);
+void generate_tone(Cue *cue, double frequency, double seconds, double level, double ramp_seconds);
+void audio_schedule(int cue, int64_t target_ns, int tag, int sync);
+int add_voice(int cue, int64_t target_ns, int tag, int sync);
+void audio_set_cadence(int64_t start_ns, int64_t end_ns, int bpm);
+void schedule_cadence(int64_t now);
+void audio_cancel(int tag);
+void audio_set_paused(int paused);
+int64_t audio_latency_ns();
+void *audio_thread_main(void *arg);
+void mix_period(int64_t heard_ns);
+void setup_mixer();
+void mix_scalar(float *mix, const short *samples, int count, float gain);
+float peak_scalar(const float *mix, int count);
+void mix_sse2(float *mix, const short *samples, int count, float gain);
+float peak_sse2(const float *mix, int count);
+void mix_avx2(float *mix, const short *samples, int count, float gain);
+float peak_avx2(const float *mix, int count);
+float limit_mix(const Mixer *m, float *mix, int count, float gain, float release);
+void bench_mixer();
+void setup_music(const char *filename);
+void cleanup_music();
+void *music_thread_main(void *arg);
+int music_open_track();
+int music_read_sample(float *value);
+void fill_music_block(short *block);
+void mix_music(int64_t heard_ns);
+void write_period();
+void schedule_countdown(int64_t boundary_ns, int64_t duration_ns);
+int64_t schedule_boundary_cues(int64_t boundary_ns, int64_t duration_ns);
+void record_av_offset(int64_t visual_ns);
+void draw_timer(const FrameState *state, int64_t now);
+void setup_glyph_cache();
+void build_base_layer();
+void build_layout(int interval, int show_next, int banner);
+void draw_clock_text(const char *time_str);
+int glyph_index(char c);
+int glyph_width(char c);
+void update_bar_fill(int y, int *drawn_fill, int fill);
+void cleanup_render_cache();
+void format_time(char *buf, size_t size, int64_t remaining_ns);
+int64_t display_unit_ns();
+int64_t next_redraw_ns(const FrameState *state, int64_t now);
 void draw_completion_message(const char *label);
-void flash_screen();
-void load_intervals(const char *filename);
+void begin_flash(FlashState *flash, int measure);
+int64_t draw_flash(FlashState *flash, int64_t now);
+void invalidate_frame();
+void refresh_program_view(const FrameState *state);
+void start_renderer();
+void stop_renderer();
+void publish_state(FrameState *state);
+void setup_status();
+void cleanup_status();
+void export_status(const FrameState *state);
+void setup_control();
+void cleanup_control();
+int control_poll_fds(struct pollfd *pfds);
+void service_control(const struct pollfd *pfds, int count);
+void handle_client_input(ControlClient *client);
+void handle_control_command(ControlClient *client, char *line);
+void control_load_done(int loaded);
+void remove_stale_socket(const char *path);
+const char *control_phase_name(int phase);
+void control_event(const FrameState *state);
+void client_printf(ControlClient *client, const char *format, ...);
+void flush_control();
+void drop_client(ControlClient *client);
+void metric_add(uint64_t *counter, uint64_t n);
+void metric_observe(MetricHistogram *histogram, int64_t value_ns);
+void setup_metrics();
+void cleanup_metrics();
+int metrics_poll_fds(struct pollfd *pfds);
+void service_metrics(const struct pollfd *pfds, int count);
+int64_t metrics_deadline_ns();
+void close_metrics_connection(MetricsConnection *connection);
+void write_metrics(MetricsConnection *connection);
+int send_metrics(MetricsConnection *connection);
+void print_counter(FILE *out, const char *name, const char *help, size_t field);
+void print_histogram(FILE *out, const char *name, const char *help, size_t field);
+void flush_frame(int64_t started_ns);
+void setup_sync();
+void cleanup_sync();
+void sync_note_state(const FrameState *state);
+int64_t sync_position(int64_t now);
+void service_sync(const struct pollfd *pfd);
+void sync_sample(const SyncPacket *packet, int64_t t4);
+int load_program(const char *filename);
+const FrameState *consume_state();
+void request_full_redraw();
+void *render_thread_main(void *arg);
+void render_wait(int64_t deadline_ns);
+int wait_for_command(int64_t deadline_ns, InputEvent *event);
+int hold_until(int64_t deadline_ns);
+int wait_for_start(int64_t start_ns, int64_t elapsed_ns);
+int pause_interval(FrameState *state, InputEvent *input, int continued);
+int64_t seek_target(const InputEvent *input, int64_t elapsed_ns);
+void edit_program(FrameState *state, const InputEvent *input);
+void load_intervals(IntervalSet *set, const char *filename);
+uint64_t hash_program(const IntervalSet *set);
+void record_edit(int command, int interval, int duration_ms);
+int replay_edits(uint32_t count);
+int parse_duration(const char *text, int *duration_ms);
+int parse_start_time(const char *text, int64_t *start_ns);
+void build_interval_index(IntervalSet *set);
+void index_add(int i, int64_t delta_ns);
+int64_t interval_start_ns(int i);
+int find_interval(int64_t elapsed_ns);
+int insert_interval(int at, const char *label, int duration_ms);
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size);
+void open_checkpoint();
+void close_checkpoint();
+int read_checkpoint(int *interval, int64_t *offset_ns);
+void write_checkpoint(uint64_t program, uint32_t edits, int interval, int64_t offset_ns, int finished);
+void checkpoint_state(const FrameState *state, int64_t now);
+const char *home_file(char *buf, size_t size, const char *name);
+void start_history();
+void stop_history();
+void push_history(HistoryRecord *record);
+void history_interval(int index, int flags, int64_t ran_ns, int64_t paused_ns);
+void history_session(int flags, int completed, int64_t ran_ns, int64_t paused_ns);
+void *history_thread_main(void *arg);
+int32_t history_week(int64_t time_s);
+int index_history_record(HistoryIndex *index, const HistoryRecord *record);
+uint32_t *find_history_label(const HistoryIndex *index, const char *label);
+int grow_history_labels(HistoryIndex *index);
+int load_history_index(HistoryIndex *index, const char *path);
+int save_history_index(const HistoryIndex *index, const char *path);
+void free_history_index(HistoryIndex *index);
+void print_history();
 void signal_handler(int sig);
-int check_x11_keypress();
+void poll_x11_input();
+void push_input(int command, int64_t arg, int64_t time_ns);
+int next_input(InputEvent *event);
+int input_queued(int command);
+void input_not_before(int64_t time_ns);
+int64_t key_event_ns(Time server_ms);
+void record_latency(LatencyHistogram *histogram, int64_t latency_ns);
+void print_latency(const char *name, const LatencyHistogram *histogram);
+void wait_for_events(int64_t deadline_ns);
+int64_t monotonic_ns();
+int64_t realtime_ns();
+void print_usage(const char *program);
+void print_stats();
+void setup_realtime();
+void prefault_stack();
+int start_thread(pthread_t *thread, void *(*start)(void *), int priority, const char *name);
+void record_timer_lateness(int64_t deadline_ns);
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <interval_file>\n", argv[0]);
-        printf("Interval file format:\n");
-        printf("label duration_seconds\n");
-        printf("Example:\n");
-        printf("Warmup 300\n");
-        printf("Sprint 30\n");
-        printf("Rest 60\n");
+    static const struct option long_options[] = {
+        {"low-power", no_argument, NULL, 'l'},
+        {"stats",     no_argument, NULL, 's'},
+        {"precision", required_argument, NULL, 'p'},
+        {"animate",   no_argument, NULL, 'a'},
+        {"fade-ms",   required_argument, NULL, 'f'},
+        {"countdown", required_argument, NULL, 'c'},
+        {"audio-period-us", required_argument, NULL, 'P'},
+        {"sounds",    required_argument, NULL, 'S'},
+        {"volume",    required_argument, NULL, 'v'},
+        {"music",     required_argument, NULL, 'm'},
+        {"music-volume", required_argument, NULL, 'M'},
+        {"bench-mix", no_argument, NULL, 'B'},
+        {"realtime",  no_argument, NULL, 'R'},
+        {"resume",    no_argument, NULL, 'r'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"history",   no_argument, NULL, 'H'},
+        {"history-file", required_argument, NULL, 'L'},
+        {"control",   required_argument, NULL, 'K'},
+        {"metrics",   required_argument, NULL, 'E'},
+        {"sync-lead", required_argument, NULL, 'G'},
+        {"sync-follow", required_argument, NULL, 'F'},
+        {"start-at",  required_argument, NULL, 'T'},
+        {"status-name", required_argument, NULL, 'N'},
+        {"help",      no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    int bench = 0;
+    int query_history = 0;
+    while ((opt = getopt_long(argc, argv, "lsp:af:c:P:S:v:m:M:RrHh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                low_power = 1;
+                break;
+            case 's':
+                show_stats = 1;
+                break;
+            case 'p':
+                display_precision = atoi(optarg);
+                if (display_precision < 0 || display_precision > 2) {
+                    printf("Error: --precision must be 0, 1 or 2\n");
+                    return 1;
+                }
+                break;
+            case 'a':
+                animate = 1;
+                break;
+            case 'f':
+                fade_ms = atoi(optarg);
+                if (fade_ms < 0) fade_ms = 0;
+                break;
+            case 'c':
+                countdown_pips = atoi(optarg);
+                if (countdown_pips < 0) countdown_pips = 0;
+                if (countdown_pips > MAX_COUNTDOWN_PIPS) {
+                    printf("Warning: At most %d countdown pips, using that\n", MAX_COUNTDOWN_PIPS);
+                    countdown_pips = MAX_COUNTDOWN_PIPS;
+                }
+                break;
+            case 'P':
+                audio_period_us = atoi(optarg);
+                if (audio_period_us < 0) audio_period_us = 0;
+                break;
+            case 'S':
+                sound_pack_file = optarg;
+                break;
+            case 'v':
+                master_volume = atoi(optarg) / 100.0f;
+                if (master_volume < 0.0f) master_volume = 0.0f;
+                break;
+            case 'm':
+                music_file = optarg;
+                break;
+            case 'M':
+                music_volume = atoi(optarg) / 100.0f;
+                if (music_volume < 0.0f) music_volume = 0.0f;
+                break;
+            case 'B':
+                bench = 1;
+                break;
+            case 'R':
+                realtime = 1;
+                break;
+            case 'r':
+                resume = 1;
+                break;
+            case 'C':
+                checkpoint_file = optarg;
+                break;
+            case 'H':
+                query_history = 1;
+                break;
+            case 'L':
+                history_file = optarg;
+                break;
+            case 'K':
+                control_path = optarg;
+                break;
+            case 'E':
+                metrics_address = optarg;
+                break;
+            case 'G':
+                sync_address = optarg;
+                clock_sync.leader = 1;
+                break;
+            case 'F':
+                sync_address = optarg;
+                clock_sync.leader = 0;
+                break;
+            case 'T':
+                if (parse_start_time(optarg, &start_at_ns) < 0) {
+                    printf("Error: Invalid start time %s, use HH:MM[:SS[.mmm]] or YYYY-MM-DD HH:MM[:SS[.mmm]]\n",
+                           optarg);
+                    return 1;
+                }
+                break;
+            case 'N':
+                status_name = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    setup_mixer();
+    if (bench) {
+        bench_mixer();
+        return 0;
+    }
+    if (query_history) {
+        print_history();
+        return 0;
+    }
+
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
         return 1;
     }
 
@@ -83,13 +993,35 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, signal_handler);
 
     // Load intervals from file
-    load_intervals(argv[1]);
+    load_intervals(&interval_set, argv[optind]);
+    program_id = hash_program(&interval_set);
 
     if (interval_set.count == 0) {
         printf("No intervals loaded. Check your interval file.\n");
         return 1;
     }
 
+    // Pick up where a killed or quit session left off, before anything slow
+    int64_t start_offset_ns = 0; // How far into the interval a seek landed
+    int session_flags = 0;
+    open_checkpoint();
+    if (resume) {
+        int interval;
+        if (read_checkpoint(&interval, &start_offset_ns)) {
+            current_interval = interval;
+            session_flags |= HISTORY_RESUMED;
+            printf("Resuming %s, %.1f s in\n", interval_set.intervals[interval].label,
+                   start_offset_ns / 1e9);
+        } else {
+            printf("Nothing to resume, starting from the beginning\n");
+        }
+    }
+
+    // Before anything else is allocated or started, so it all stays resident
+    if (realtime) {
+        setup_realtime();
+    }
+
     // Initialize X11 display and window
     setup_x11_window();
     if (!display) {
@@ -103,53 +1035,238 @@ int main(int argc, char *argv[]) {
     // Prevent screen sleep
     prevent_screen_sleep();
 
-    // Main timer loop
-    elapsed_training_time = 0;
+    // Let the kernel batch our timer wakeups with other work
+    if (low_power) {
+        prctl(PR_SET_TIMERSLACK, LOW_POWER_TIMER_SLACK_NS, 0, 0, 0);
+    }
+
+    // Main timer loop. This thread only keeps time, handles input and drives
+    // the cues; the render thread draws whatever state it last published.
+    setup_status();
+    setup_control();
+    setup_metrics();
+    setup_sync();
+    start_renderer();
+    start_history();
+
+    // With a start time, everything above is ready well before it
+    if (start_at_ns > 0) {
+        time_t start = start_at_ns / NSEC_PER_SEC;
+        int ms = (int)(start_at_ns % NSEC_PER_SEC / NSEC_PER_MSEC);
+        struct tm tm;
+        localtime_r(&start, &tm);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+        strftime(start_at_text, sizeof(start_at_text), "%H:%M:%S", &tm);
+        if (ms > 0) {
+            snprintf(start_at_text + strlen(start_at_text), sizeof(start_at_text) - strlen(start_at_text), ".%03d", ms);
+        }
+        if (start_at_ns <= realtime_ns()) {
+            printf("Warning: %s %s has already passed, starting now\n", date, start_at_text);
+        } else {
+            printf("Starting at %s %s\n", date, start_at_text);
+        }
+        wait_for_start(start_at_ns, interval_start_ns(current_interval) + start_offset_ns);
+    }
+    stats.start_ns = monotonic_ns();
+    FrameState state;
+    memset(&state, 0, sizeof(state));
+    int64_t seek_input_ns = 0;
+    int seek_paused = 0;         // The seek came while paused, so land paused
+    int64_t session_ran_ns = 0;  // Training time, for the history
     while (running && current_interval < interval_set.count) {
         Interval *interval = &interval_set.intervals[current_interval];
-        time_remaining = interval->duration;
-
-        while (time_remaining > 0 && running) {
-            int minutes = time_remaining / 60;
-            int seconds = time_remaining % 60;
+        int64_t interval_ns = interval->duration_ms * NSEC_PER_MSEC;
+        int64_t interval_end = monotonic_ns() + interval_ns - start_offset_ns;
+        int64_t entered_offset_ns = start_offset_ns;
+        int64_t paused_before_ns = stats.paused_ns;
+        int64_t burst_start = schedule_boundary_cues(interval_end, interval_ns - start_offset_ns);
+        audio_set_cadence(interval_end - interval_ns, interval_end, interval->bpm);
 
-            draw_timer(minutes, seconds, interval->label, time_remaining);
+        // Keys held over from the last boundary act on this interval from
+        // its start; their own stamps predate it
+        input_not_before(interval_end - interval_ns + start_offset_ns);
+        if (start_offset_ns == 0 && !seek_paused) {
+            play_prompt(interval->label);
+        }
+        start_offset_ns = 0;
 
-            sleep(1);
-            time_remaining--;
-            elapsed_training_time++;
+        // The renderer counts down and flashes on the boundary by itself
+        state.phase = PHASE_RUNNING;
+        state.interval = current_interval;
+        state.interval_end_ns = interval_end;
+        state.interval_ns = interval_ns;
+        state.elapsed_before_ns = interval_start_ns(current_interval);
+        state.session_ns = interval_set.total_ns;
+        state.program_version = interval_set.version;
+        state.flash_ns = interval_end;
+        state.input_ns = seek_input_ns;
+        seek_input_ns = 0;
 
-            // Check for key press to skip interval
-            int key = check_x11_keypress();
-            if (key == 'q' || key == 'Q' || key == 27) { // Q, q, or Escape
-                running = 0;
-                break;
-            } else if (key == 's' || key == 'S') {
-                // Add remaining time to elapsed time when skipping
-                elapsed_training_time += time_remaining;
-                break; // Skip to next interval
+        // Seeking while paused moves the stopped clock; only the pause key
+        // sets it going again
+        InputEvent input;
+        int command;
+        int continued = seek_paused;
+        int from_pause = 0;
+        if (seek_paused) {
+            input.command = CMD_PAUSE;
+            input.arg = 0;
+            input.time_ns = interval_end - interval_ns + entered_offset_ns;
+            command = CMD_PAUSE;
+            seek_paused = 0;
+        } else {
+            publish_state(&state);
+            state.input_ns = 0;
+            command = wait_for_command(interval_end, &input);
+        }
+        while (command == CMD_PAUSE || command == CMD_ADJUST || command == CMD_INSERT_REST || command == CMD_SYNC ||
+               command == CMD_SYNC_STEP) {
+            if (command == CMD_PAUSE) {
+                command = pause_interval(&state, &input, continued);
+                continued = 0;
+                interval_end = state.interval_end_ns;
+                interval_ns = state.interval_ns; // May have been edited meanwhile
+                if (command != CMD_PAUSE) {
+                    from_pause = 1;
+                    continue; // The key that ended the pause still counts
+                }
+            } else if (command == CMD_SYNC || command == CMD_SYNC_STEP) {
+                // Slewed a little towards the sync leader's schedule, or
+                // stepped onto it; a step out of this interval goes below
+                int64_t end = interval_end + input.arg;
+                if (command == CMD_SYNC_STEP && (end <= input.time_ns || end - interval_ns > input.time_ns)) {
+                    break;
+                }
+                interval_end = end;
+                state.interval_end_ns = interval_end;
+                state.flash_ns = interval_end;
+                publish_state(&state);
+                audio_cancel(TAG_BEEP);
+                audio_cancel(TAG_COUNTDOWN);
+            } else {
+                edit_program(&state, &input);
+                interval_end = state.interval_end_ns;
+                interval_ns = state.interval_ns;
             }
+
+            // The rest of the interval and its cues move with the new end:
+            // later by exactly the time spent paused, or by the edit
+            burst_start = schedule_boundary_cues(interval_end, interval_end - monotonic_ns());
+            audio_set_cadence(interval_end - interval_ns, interval_end, interval->bpm);
+            command = wait_for_command(interval_end, &input);
+            from_pause = 0;
+        }
+
+        // How long this interval ran, from where it was entered to where
+        // it was left; pauses moved interval_end, so they aren't in it
+        int64_t left_ns = command == CMD_NONE ? interval_end : input.time_ns;
+        if (!running && command == CMD_NONE) left_ns = monotonic_ns();
+        int64_t ran_ns = interval_ns - (interval_end - left_ns) - entered_offset_ns;
+        if (ran_ns < 0) ran_ns = 0;
+        int64_t interval_paused_ns = stats.paused_ns - paused_before_ns;
+        session_ran_ns += ran_ns;
+
+        if (!running || command == CMD_QUIT) {
+            history_interval(current_interval, HISTORY_QUIT, ran_ns, interval_paused_ns);
+            running = 0;
+            break;
+        }
+
+        // A sync step into another interval lands like a seek, but the user
+        // didn't leave this one: no history row, and prompts and clicks
+        // already playing carry on
+        if (command == CMD_SYNC_STEP) {
+            audio_cancel(TAG_BEEP);
+            audio_cancel(TAG_COUNTDOWN);
+            int64_t elapsed_ns = state.elapsed_before_ns + interval_ns - (interval_end - input.time_ns);
+            int64_t target = seek_target(&input, elapsed_ns);
+            current_interval = find_interval(target);
+            start_offset_ns = target - interval_start_ns(current_interval);
+            continue;
         }
 
-        if (running) {
-            // Interval finished - flash and beep at the end
-            flash_screen();
-            reset_audio(); // Reset audio before playing
-            play_beep();
-            
-            // Show completion message briefly
-            draw_completion_message(interval->label);
-            
-            // Move to next interval immediately
-            current_interval++;
-            
-            // If there are more intervals, start the next one immediately
-            if (current_interval < interval_set.count) {
-                // Brief pause to show completion message
-                usleep(500000); // 0.5 seconds
+        // Seeking restarts the loop at whatever interval the target lands
+        // in, part way through; no boundary is played for it
+        if (command == CMD_SCRUB || command == CMD_PREVIOUS || command == CMD_JUMP || command == CMD_LOAD) {
+            history_interval(current_interval, HISTORY_SEEKED, ran_ns, interval_paused_ns);
+            reset_audio();
+            seek_input_ns = input.time_ns;
+            if (command == CMD_LOAD) {
+                // A new program from the control socket starts from its top;
+                // one that can't be loaded leaves the session where it was
+                int loaded = load_program(control_program) == 0;
+                control_load_done(loaded);
+                if (loaded) {
+                    current_interval = 0;
+                    start_offset_ns = 0;
+                    continue;
+                }
+                printf("Warning: No intervals in %s, keeping the current program\n", control_program);
             }
+            int64_t elapsed_ns = state.elapsed_before_ns + interval_ns - (interval_end - input.time_ns);
+            int64_t target = seek_target(&input, elapsed_ns);
+            current_interval = find_interval(target);
+            start_offset_ns = target - interval_start_ns(current_interval);
+            seek_paused = from_pause;
+            continue;
+        }
+
+        // Interval finished - flash and beep together. A boundary that ran
+        // out already has its cues scheduled; a skip plays them as soon as
+        // the device can, and the flash waits for the sound.
+        history_interval(current_interval, command == CMD_SKIP ? HISTORY_SKIPPED : 0, ran_ns, interval_paused_ns);
+        int64_t onset = interval_end;
+        if (command == CMD_SKIP) {
+            reset_audio(); // Those cues belonged to the skipped boundary
+            burst_start = play_beep(0, 1);
+            onset = burst_start > 0 ? burst_start : monotonic_ns();
+            state.phase = PHASE_FLASH;
+            state.flash_ns = burst_start;
+            state.input_ns = input.time_ns;
+            publish_state(&state);
+            state.input_ns = 0;
+        }
+
+        // Hold the boundary until the flash and the beeps are over
+        int64_t hold = onset + FLASH_STEPS * FLASH_STEP_NS;
+        if (burst_start > 0 && burst_start + beep_burst_ns() > hold) {
+            hold = burst_start + beep_burst_ns();
+        }
+        if (hold_until(hold) == CMD_QUIT) {
+            running = 0;
+            break;
+        }
+
+        // Show completion message briefly
+        state.phase = PHASE_COMPLETE;
+        publish_state(&state);
+        current_interval++;
+        metric_add(&thread_metrics[THREAD_TIMER].intervals_completed, 1);
+        if (current_interval >= interval_set.count) {
+            metric_add(&thread_metrics[THREAD_TIMER].sessions_completed, 1);
+        }
+
+        // Brief pause to show the completion message before the next interval
+        hold = monotonic_ns() + FLASH_STEPS * FLASH_STEP_NS;
+        if (current_interval < interval_set.count) {
+            hold += 500000000LL; // 0.5 seconds
+        }
+        if (hold_until(hold) == CMD_QUIT) {
+            running = 0;
         }
     }
+    stop_renderer();
+    cleanup_control();
+    cleanup_metrics();
+    cleanup_sync();
+    cleanup_status();
+    close_checkpoint();
+    if (current_interval < interval_set.count) {
+        session_flags |= HISTORY_QUIT;
+    }
+    history_session(session_flags, current_interval, session_ran_ns, stats.paused_ns);
+    stop_history();
 
     // Cleanup
     allow_screen_sleep();
@@ -157,9 +1274,109 @@ int main(int argc, char *argv[]) {
     cleanup_audio();
 
     printf("\nInterval training completed!\n");
+    if (show_stats) {
+        print_stats();
+    }
     return 0;
 }
 
+void print_usage(const char *program) {
+    printf("Usage: %s [options] <interval_file>\n", program);
+    printf("Options:\n");
+    printf("  -l, --low-power  Coalesce wakeups and let the display power down\n");
+    printf("  -s, --stats      Print wakeup, frame and CPU statistics on exit\n");
+    printf("  -p, --precision N  Show N digits after the seconds (0-2)\n");
+    printf("  -a, --animate    Move progress bars smoothly and blend flash colours\n");
+    printf("  -f, --fade-ms N  Duration of each flash colour blend (default 150)\n");
+    printf("  -c, --countdown N  Pip on each of the last N seconds (up to 20) and on the boundary\n");
+    printf("  -P, --audio-period-us N  Audio period to request (default: smallest stable)\n");
+    printf("  -S, --sounds FILE  Sound pack: lines of 'beep|pip|final|click|start:<label> file.wav'\n");
+    printf("  -v, --volume N   Master volume in percent (default 100)\n");
+    printf("  -m, --music FILE  Play a WAV file or playlist under the cues\n");
+    printf("  --music-volume N  Music volume in percent (default 50)\n");
+    printf("  -R, --realtime   Real-time priority for timing and audio, memory locked\n");
+    printf("  -r, --resume     Continue from where the last session was stopped\n");
+    printf("  --checkpoint FILE  Where to keep the position (default ~/.interval_timer_checkpoint)\n");
+    printf("  -H, --history    Print weekly totals and skip rates from past sessions and exit\n");
+    printf("  --history-file FILE  Session history log (default ~/.interval_timer_history)\n");
+    printf("  --control SOCKET  Accept commands and send events on a UNIX socket\n");
+    printf("  --metrics PORT|SOCKET  Serve Prometheus metrics on a loopback port or UNIX socket\n");
+    printf("  --sync-lead PORT  Let other instances follow this one's schedule over UDP\n");
+    printf("  --sync-follow HOST:PORT  Keep to the schedule of the instance leading there\n");
+    printf("  --start-at TIME  Get ready, then start at HH:MM[:SS[.mmm]] (or YYYY-MM-DD HH:MM...)\n");
+    printf("  --status-name NAME  Shared-memory name for the live status (default %s)\n", STATUS_SHM_NAME);
+    printf("  --bench-mix      Measure mixer throughput and exit\n");
+    printf("  -h, --help       Show this help\n");
+    printf("Interval file format:\n");
+    printf("label duration [@Nbpm], duration in seconds (7.5) or mm:ss (1:30.5)\n");
+    printf("Example:\n");
+    printf("Warmup 5:00\n");
+    printf("Sprint 30 @110bpm\n");
+    printf("Rest 1:30.5\n");
+}
+
+void print_stats() {
+    double wall = (monotonic_ns() - stats.start_ns) / 1e9;
+    if (wall <= 0) wall = 1e-9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    printf("Session statistics:\n");
+    printf("  Wall time:      %.1f s\n", wall);
+    if (stats.pauses > 0) {
+        printf("  Paused:         %.3f s over %ld pause%s\n", stats.paused_ns / 1e9, stats.pauses,
+               stats.pauses == 1 ? "" : "s");
+    }
+    printf("  Wakeups:        %ld timer (%.2f/s), %ld render (%.2f/s)\n",
+           stats.wakeups, stats.wakeups / wall, stats.render_wakeups, stats.render_wakeups / wall);
+    printf("  Frames:         %ld drawn, %ld skipped\n", stats.frames_drawn, stats.frames_skipped);
+    printf("  CPU time:       %.3f s user, %.3f s system (%.2f s per hour)\n",
+           user, sys, (user + sys) * 3600.0 / wall);
+    printf("  Audio underruns: %ld\n", stats.audio_underruns);
+    if (stats.voices_dropped > 0) {
+        printf("  Voices dropped: %ld cues found every voice in use\n", stats.voices_dropped);
+    }
+    if (music_file) {
+        printf("  Music dropouts: %ld periods\n", stats.music_dropouts);
+    }
+    if (audio_engine.rate > 0) {
+        print_audio_config("  Audio device:   ");
+    }
+    if (stats.timer_waits > 0) {
+        printf("  Timer lateness: %.0f us mean, %.0f us max over %ld waits\n",
+               stats.timer_late_sum_us / stats.timer_waits, stats.timer_late_max_us, stats.timer_waits);
+    }
+    if (stats.audio_periods > 0) {
+        printf("  Audio jitter:   %.0f us mean, %.0f us max over %ld periods\n",
+               stats.audio_jitter_sum_us / stats.audio_periods, stats.audio_jitter_max_us, stats.audio_periods);
+    }
+    if (stats.onset_count > 0) {
+        printf("  Cue onset error: %.0f us mean, %.0f us max over %ld cues\n",
+               stats.onset_error_sum_us / stats.onset_count, stats.onset_error_max_us, stats.onset_count);
+    }
+    print_latency("Key delivery", &stats.key_delivery);
+    print_latency("Input to flush", &stats.input_to_flush);
+    if (stats.input_dropped > 0) {
+        printf("  Input dropped:  %ld commands\n", stats.input_dropped);
+    }
+    if (start_at_ns > 0) {
+        printf("  Start:          %+.0f us from the scheduled time\n", stats.start_error_ns / 1000.0);
+    }
+    if (stats.sync_rounds > 0) {
+        printf("  Sync:           %ld round trips, %.0f us best delay, %+.0f us offset\n", stats.sync_rounds,
+               clock_sync.delay_ns / 1000.0, clock_sync.offset_ns / 1000.0);
+        printf("  Sync error:     %+.0f us last, %.0f us max; %ld slews, %ld steps\n", clock_sync.error_ns / 1000.0,
+               stats.sync_error_max_us, stats.sync_slews, stats.sync_steps);
+    }
+    if (stats.av_count > 0) {
+        printf("  A/V offset:     %+.0f us mean (flash after sound), %.0f us max over %ld cues\n",
+               stats.av_offset_sum_us / stats.av_count, stats.av_offset_max_us, stats.av_count);
+    }
+}
+
 void setup_x11_window() {
     display = XOpenDisplay(NULL);
     if (!display) return;
@@ -181,6 +1398,17 @@ void setup_x11_window() {
                 screen_width = crtc_info->width;
                 screen_height = crtc_info->height;
             }
+            // Refresh rate of the active mode paces sub-second redraws
+            for (int i = 0; crtc_info && i < resources->nmode; i++) {
+                XRRModeInfo *mode = &resources->modes[i];
+                if (mode->id != crtc_info->mode) continue;
+                double vtotal = mode->vTotal;
+                if (mode->modeFlags & RR_DoubleScan) vtotal *= 2;
+                if (mode->modeFlags & RR_Interlace) vtotal /= 2;
+                if (mode->hTotal > 0 && vtotal > 0) {
+                    refresh_rate = mode->dotClock / (mode->hTotal * vtotal);
+                }
+            }
             XRRFreeCrtcInfo(crtc_info);
         }
         XRRFreeOutputInfo(output_info);
@@ -240,6 +1468,11 @@ void setup_x11_window() {
     
     // Set window name
     XStoreName(display, window, "Interval Timer");
+
+    // Ask for a message rather than a disconnect when the window is closed
+    wm_protocols = XInternAtom(display, "WM_PROTOCOLS", False);
+    wm_delete_window = XInternAtom(display, "WM_DELETE_WINDOW", False);
+    XSetWMProtocols(display, window, &wm_delete_window, 1);
     
     // Set fullscreen
     Atom wm_state = XInternAtom(display, "_NET_WM_STATE", False);
@@ -253,26 +1486,46 @@ void setup_x11_window() {
     // Give the window manager time to process the window
     usleep(100000); // 100ms
     
+    // Drawing goes over its own connection, so the render thread never
+    // shares Xlib state with input handling. The window must exist on the
+    // server before the second connection can use it.
+    XSync(display, False);
+    render_display = XOpenDisplay(NULL);
+    XVisualInfo render_vinfo;
+    if (!render_display ||
+        XMatchVisualInfo(render_display, DefaultScreen(render_display), 32, TrueColor, &render_vinfo) == 0) {
+        printf("Error: Cannot open a drawing connection to the X11 display\n");
+        if (render_display) XCloseDisplay(render_display);
+        render_display = NULL;
+        XDestroyWindow(display, window);
+        XCloseDisplay(display);
+        display = NULL;
+        return;
+    }
+
     // Create Cairo surface
-    surface = cairo_xlib_surface_create(display, window, vinfo.visual, screen_width, screen_height);
+    surface = cairo_xlib_surface_create(render_display, window, render_vinfo.visual, screen_width, screen_height);
     cr = cairo_create(surface);
 }
 
 void cleanup_x11() {
+    cleanup_render_cache();
     if (cr) cairo_destroy(cr);
     if (surface) cairo_surface_destroy(surface);
+    if (render_display) XCloseDisplay(render_display);
     if (window) XDestroyWindow(display, window);
     if (display) XCloseDisplay(display);
 }
 
 void prevent_screen_sleep() {
-    if (display) {
+    // In low-power mode the display follows the system power policy
+    if (display && !low_power) {
         DPMSDisable(display);
     }
 }
 
 void allow_screen_sleep() {
-    if (display) {
+    if (display && !low_power) {
         DPMSEnable(display);
     }
 }
@@ -285,33 +1538,188 @@ void setup_audio() {
         return;
     }
 
-    snd_pcm_hw_params_t *params;
-    snd_pcm_hw_params_alloca(&params);
-    snd_pcm_hw_params_any(audio_handle, params);
-    snd_pcm_hw_params_set_access(audio_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(audio_handle, params, SND_PCM_FORMAT_S16_LE);
-    snd_pcm_hw_params_set_channels(audio_handle, params, 1);
-    snd_pcm_hw_params_set_rate(audio_handle, params, 44100, 0);
-    snd_pcm_hw_params_set_period_size(audio_handle, params, 1024, 0);
-
-    err = snd_pcm_hw_params(audio_handle, params);
+    err = negotiate_audio(0);
     if (err < 0) {
         printf("Warning: Cannot set audio parameters: %s\n", snd_strerror(err));
         snd_pcm_close(audio_handle);
         audio_handle = NULL;
         return;
     }
-    
+
     // Prepare the audio device
     err = snd_pcm_prepare(audio_handle);
     if (err < 0) {
         printf("Warning: Cannot prepare audio device: %s\n", snd_strerror(err));
         snd_pcm_close(audio_handle);
         audio_handle = NULL;
+        return;
+    }
+
+    build_cue_bank();
+    if (sound_pack_file) {
+        load_sound_pack(sound_pack_file);
+    }
+    print_audio_config("Audio: ");
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&audio_engine.wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&audio_engine.lock, NULL);
+
+    audio_engine.running = 1;
+    if (start_thread(&audio_engine.thread, audio_thread_main, AUDIO_RT_PRIORITY, "audio") != 0) {
+        printf("Warning: Cannot start audio thread\n");
+        audio_engine.running = 0;
+        snd_pcm_close(audio_handle);
+        audio_handle = NULL;
+        return;
+    }
+    audio_engine.started = 1;
+
+    if (music_file) {
+        setup_music(music_file);
+    }
+}
+
+int negotiate_audio(unsigned int rate) {
+    snd_pcm_hw_params_t *params;
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(audio_handle, params);
+    snd_pcm_hw_params_set_access(audio_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+
+    // Only offer what the device does natively, so the plug layer has
+    // nothing to resample or convert
+    snd_pcm_hw_params_set_rate_resample(audio_handle, params, 0);
+
+    static const snd_pcm_format_t formats[] = {
+        SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE
+    };
+    snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (snd_pcm_hw_params_test_format(audio_handle, params, formats[i]) == 0) {
+            format = formats[i];
+            break;
+        }
+    }
+    if (format == SND_PCM_FORMAT_UNKNOWN) return -EINVAL;
+    snd_pcm_hw_params_set_format(audio_handle, params, format);
+
+    // Cues are mono; use as few channels as the device allows
+    unsigned int channels = 1;
+    snd_pcm_hw_params_get_channels_min(params, &channels);
+    if (channels < 1) channels = 1;
+    snd_pcm_hw_params_set_channels_near(audio_handle, params, &channels);
+
+    // Keep a rate we already run at, otherwise prefer the usual native rates
+    int dir = 0;
+    if (rate == 0) {
+        rate = 48000;
+        if (snd_pcm_hw_params_test_rate(audio_handle, params, 48000, 0) != 0 &&
+            snd_pcm_hw_params_test_rate(audio_handle, params, 44100, 0) == 0) {
+            rate = 44100;
+        }
     }
+    snd_pcm_hw_params_set_rate_near(audio_handle, params, &rate, &dir);
+
+    // Smallest period the device takes, unless underruns have shown we need more
+    snd_pcm_uframes_t period_min = 0;
+    snd_pcm_hw_params_get_period_size_min(params, &period_min, &dir);
+    snd_pcm_uframes_t period = audio_engine.period_target;
+    if (period == 0) {
+        // Music keeps the stream running nonstop, so it gets a longer period
+        // than the few wakeups of bare cues need: 50 a second instead of 500.
+        // Cues are scheduled well ahead and still land on their exact sample.
+        int period_us = audio_period_us > 0 ? audio_period_us : music_file ? MUSIC_PERIOD_US : AUDIO_MIN_PERIOD_US;
+        period = (snd_pcm_uframes_t)rate * period_us / 1000000;
+    }
+    if (period < period_min) period = period_min;
+    dir = 0;
+    snd_pcm_hw_params_set_period_size_near(audio_handle, params, &period, &dir);
+    snd_pcm_uframes_t buffer_size = period * AUDIO_PERIODS;
+    snd_pcm_hw_params_set_buffer_size_near(audio_handle, params, &buffer_size);
+
+    int err = snd_pcm_hw_params(audio_handle, params);
+    if (err < 0) return err;
+
+    // Read back what the device actually gave us
+    snd_pcm_hw_params_get_rate(params, &rate, &dir);
+    snd_pcm_hw_params_get_channels(params, &channels);
+    snd_pcm_hw_params_get_period_size(params, &period, &dir);
+    snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
+
+    // Start playing as soon as one period is queued, so scheduled cues
+    // aren't held back until the whole buffer has filled
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_sw_params_alloca(&sw_params);
+    snd_pcm_sw_params_current(audio_handle, sw_params);
+    snd_pcm_sw_params_set_start_threshold(audio_handle, sw_params, period);
+    // Have status reports timestamped on our clock, to line pictures up with sound
+    snd_pcm_sw_params_set_tstamp_mode(audio_handle, sw_params, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type(audio_handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    snd_pcm_sw_params(audio_handle, sw_params);
+
+    int sample_bytes = format == SND_PCM_FORMAT_S16_LE ? 2 : 4;
+    float *mix = malloc(period * sizeof(float));
+    void *output = malloc(period * channels * sample_bytes);
+    if (!mix || !output) {
+        free(mix);
+        free(output);
+        return -ENOMEM;
+    }
+    free(audio_engine.mix);
+    free(audio_engine.output);
+    audio_engine.mix = mix;
+    audio_engine.limiter_gain = 1.0f;
+    audio_engine.output = output;
+
+    audio_engine.rate = rate;
+    audio_engine.channels = channels;
+    audio_engine.format = format;
+    audio_engine.period_frames = (int)period;
+    audio_engine.buffer_frames = (int)buffer_size;
+    audio_engine.period_target = (int)period;
+    return 0;
+}
+
+void build_cue_bank() {
+    // Beep sound at nearly full scale, as it always was
+    generate_tone(&audio_engine.cues[CUE_BEEP], 600.0, 0.3, 0.98, 0.0);
+    // Countdown pips, with short ramps so they don't click
+    generate_tone(&audio_engine.cues[CUE_PIP], 880.0, 0.08, 0.73, 0.005);
+    generate_tone(&audio_engine.cues[CUE_FINAL_PIP], 1320.0, 0.25, 0.85, 0.005);
+    // Short, high click for cadence, quieter so it sits under the music
+    generate_tone(&audio_engine.cues[CUE_CLICK], 2000.0, 0.02, 0.6, 0.002);
+    audio_engine.cue_count = CUE_COUNT;
+}
+
+void print_audio_config(const char *prefix) {
+    printf("%s%u Hz %s, %u channel%s, period %d frames (%.1f ms), latency %.1f ms\n",
+           prefix, audio_engine.rate, snd_pcm_format_name(audio_engine.format),
+           audio_engine.channels, audio_engine.channels == 1 ? "" : "s",
+           audio_engine.period_frames, audio_engine.period_frames * 1000.0 / audio_engine.rate,
+           audio_engine.buffer_frames * 1000.0 / audio_engine.rate);
 }
 
 void cleanup_audio() {
+    if (audio_engine.started) {
+        pthread_mutex_lock(&audio_engine.lock);
+        audio_engine.running = 0;
+        pthread_cond_signal(&audio_engine.wake);
+        pthread_mutex_unlock(&audio_engine.lock);
+        pthread_join(audio_engine.thread, NULL);
+        audio_engine.started = 0;
+    }
+    cleanup_music();
+    for (int i = 0; i < audio_engine.cue_count; i++) {
+        free_cue(&audio_engine.cues[i]);
+    }
+    audio_engine.cue_count = 0;
+    free(audio_engine.mix);
+    free(audio_engine.output);
+    audio_engine.mix = NULL;
+    audio_engine.output = NULL;
     if (audio_handle) {
         snd_pcm_close(audio_handle);
         audio_handle = NULL;
@@ -319,285 +1727,3902 @@ void cleanup_audio() {
 }
 
 void reset_audio() {
-    if (audio_handle) {
-        snd_pcm_drop(audio_handle);
-        snd_pcm_prepare(audio_handle);
-    }
+    // Silence anything still queued before a new cue
+    audio_cancel(-1);
 }
 
-void play_beep() {
-    if (!audio_handle) return;
+int64_t play_beep(int64_t start_ns, int sync) {
+    if (!audio_handle) return 0;
 
-    // Reset audio device to ensure clean state
-    snd_pcm_drop(audio_handle);
-    snd_pcm_prepare(audio_handle);
+    // Without a start time, go as soon as the device can make it audible
+    if (start_ns == 0) {
+        start_ns = monotonic_ns() + audio_latency_ns();
+    }
 
-    // Generate maximum volume beep sound
-    short buffer[13230]; // 0.3 second at 44.1kHz (longer duration)
-    for (int i = 0; i < 13230; i++) {
-        // Use maximum amplitude (32767) for the loudest possible sound
-        buffer[i] = (short)(sin(2.0 * M_PI * 600.0 * i / 44100.0) * 32000);
+    // A recorded boundary sound plays once
+    if (audio_engine.beep_is_sample) {
+        audio_schedule(CUE_BEEP, start_ns, TAG_BEEP, sync);
+        return start_ns;
     }
 
-    // Play multiple loud beeps with proper error handling
+    // Play multiple loud beeps with pauses for better separation
     for (int beep = 0; beep < 5; beep++) {
-        // Reset device before each beep to ensure clean state
-        snd_pcm_drop(audio_handle);
-        snd_pcm_prepare(audio_handle);
-        
-        snd_pcm_sframes_t frames = snd_pcm_writei(audio_handle, buffer, 13230);
-        if (frames < 0) {
-            // Try to recover from error
-            if (snd_pcm_recover(audio_handle, frames, 0) >= 0) {
-                snd_pcm_prepare(audio_handle);
-                frames = snd_pcm_writei(audio_handle, buffer, 13230);
-            }
-        }
-        
-        if (frames >= 0) {
-            snd_pcm_drain(audio_handle);
-        }
-        
-        // Longer pause between beeps for better separation
-        usleep(100000); // 100ms pause
+        audio_schedule(CUE_BEEP, start_ns + beep * BEEP_SPACING_NS, TAG_BEEP, sync && beep == 0);
     }
+    return start_ns;
 }
 
-void draw_timer(int minutes, int seconds, const char *label, int time_remaining) {
-    if (!cr) return;
-
-    // Clear background
-    cairo_set_source_rgb(cr, 0.0, 0.0, 0.0); // Black background
-    cairo_paint(cr);
+int64_t beep_burst_ns() {
+    if (audio_engine.beep_is_sample) {
+        return (int64_t)audio_engine.cues[CUE_BEEP].frames * NSEC_PER_SEC / audio_engine.rate;
+    }
+    return BEEP_BURST_NS;
+}
 
-    // Set up text properties
-    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0); // White text
+void play_prompt(const char *label) {
+    if (!audio_handle) return;
+
+    for (int i = CUE_COUNT; i < audio_engine.cue_count; i++) {
+        if (strcmp(audio_engine.cue_labels[i], label) == 0) {
+            audio_schedule(i, monotonic_ns() + audio_latency_ns(), TAG_PROMPT, 0);
+            return;
+        }
+    }
+}
+
+void load_sound_pack(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("Warning: Cannot open sound pack %s\n", filename);
+        return;
+    }
+
+    // Sample paths are relative to the sound pack file
+    char base[MAX_PATH_LENGTH];
+    strncpy(base, filename, sizeof(base) - 1);
+    base[sizeof(base) - 1] = '\0';
+    char *slash = strrchr(base, '/');
+    if (slash) {
+        slash[1] = '\0';
+    } else {
+        base[0] = '\0';
+    }
+
+    char line[MAX_PATH_LENGTH];
+    while (fgets(line, sizeof(line), file)) {
+        char name[MAX_LABEL_LENGTH + 8];
+        char sample[MAX_PATH_LENGTH];
+        if (line[0] == '#' || sscanf(line, "%57s %4095s", name, sample) != 2) continue;
+
+        char path[MAX_PATH_LENGTH * 2];
+        snprintf(path, sizeof(path), "%s%s", sample[0] == '/' ? "" : base, sample);
+
+        int index;
+        if (strcmp(name, "beep") == 0) {
+            index = CUE_BEEP;
+        } else if (strcmp(name, "pip") == 0) {
+            index = CUE_PIP;
+        } else if (strcmp(name, "click") == 0) {
+            index = CUE_CLICK;
+        } else if (strcmp(name, "final") == 0) {
+            index = CUE_FINAL_PIP;
+        } else if (strncmp(name, "start:", 6) == 0 && audio_engine.cue_count < MAX_CUES) {
+            index = audio_engine.cue_count;
+        } else {
+            printf("Warning: Unknown sound pack entry '%s'\n", name);
+            continue;
+        }
+
+        Cue cue;
+        memset(&cue, 0, sizeof(cue));
+        if (load_sample_cue(&cue, path) < 0) {
+            printf("Warning: Cannot load sample %s, keeping the built-in sound\n", path);
+            continue;
+        }
+        cue.gain = 1.0f;
+
+        if (index < CUE_COUNT) {
+            free_cue(&audio_engine.cues[index]);
+            if (index == CUE_BEEP) audio_engine.beep_is_sample = 1;
+        } else {
+            strncpy(audio_engine.cue_labels[index], name + 6, MAX_LABEL_LENGTH - 1);
+            audio_engine.cue_labels[index][MAX_LABEL_LENGTH - 1] = '\0';
+            audio_engine.cue_count++;
+        }
+        audio_engine.cues[index] = cue;
+    }
+
+    fclose(file);
+}
+
+int load_sample_cue(Cue *cue, const char *path) {
+    struct stat source;
+    if (stat(path, &source) < 0) return -1;
+
+    // Decoded samples are cached per device rate; a hit is just an mmap
+    char cache_path[MAX_PATH_LENGTH];
+    int have_cache = pcm_cache_path(cache_path, sizeof(cache_path), path, &source) == 0;
+    if (have_cache && map_pcm_cache(cue, cache_path, &source) == 0) {
+        return 0;
+    }
+
+    unsigned int rate;
+    int frames;
+    float *decoded = decode_wav(path, &rate, &frames);
+    if (!decoded) return -1;
+    int output_frames;
+    short *samples = resample_to_s16(decoded, frames, rate, audio_engine.rate, &output_frames);
+    free(decoded);
+    if (!samples) return -1;
+
+    // Write the cache next to where it will live, then move it into place
+    // so a crash never leaves a half-written file behind
+    if (have_cache) {
+        char tmp_path[MAX_PATH_LENGTH + 32];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, (int)getpid());
+        FILE *out = fopen(tmp_path, "wb");
+        if (out) {
+            PcmCacheHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, PCM_CACHE_MAGIC, sizeof(header.magic));
+            header.rate = audio_engine.rate;
+            header.frames = output_frames;
+            header.source_size = source.st_size;
+            header.source_mtime = source.st_mtime;
+            int ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                     fwrite(samples, sizeof(short), output_frames, out) == (size_t)output_frames;
+            ok = fclose(out) == 0 && ok;
+            if (ok && rename(tmp_path, cache_path) == 0 && map_pcm_cache(cue, cache_path, &source) == 0) {
+                free(samples);
+                return 0;
+            }
+            unlink(tmp_path);
+        }
+    }
+
+    // No usable cache directory; keep the decoded copy in memory instead
+    cue->samples = samples;
+    cue->frames = output_frames;
+    return 0;
+}
+
+int map_pcm_cache(Cue *cue, const char *cache_path, const struct stat *source) {
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(PcmCacheHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const PcmCacheHeader *header = map;
+    if (memcmp(header->magic, PCM_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->rate != audio_engine.rate || header->source_size != source->st_size ||
+        header->source_mtime != source->st_mtime ||
+        (size_t)st.st_size < sizeof(PcmCacheHeader) + (size_t)header->frames * sizeof(short)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Fault every page in now so playback never waits on the disk
+    madvise(map, st.st_size, MADV_WILLNEED);
+    volatile const char *bytes = map;
+    for (off_t offset = 0; offset < st.st_size; offset += 4096) {
+        (void)bytes[offset];
+    }
+
+    cue->map = map;
+    cue->map_size = st.st_size;
+    cue->samples = (short *)((char *)map + sizeof(PcmCacheHeader));
+    cue->frames = header->frames;
+    return 0;
+}
+
+int pcm_cache_path(char *buf, size_t size, const char *source_path, const struct stat *source) {
+    char dir[MAX_PATH_LENGTH];
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache_home && cache_home[0]) {
+        snprintf(dir, sizeof(dir), "%s", cache_home);
+    } else if (home && home[0]) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return -1;
+    }
+    mkdir(dir, 0755);
+    strncat(dir, "/interval_timer", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+
+    // Key on where the sample is, which version of it, and the device rate
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    char key[MAX_PATH_LENGTH + 64];
+    int len = snprintf(key, sizeof(key), "%s|%lld|%lld|%u", source_path, (long long)source->st_size,
+                       (long long)source->st_mtime, audio_engine.rate);
+    for (int i = 0; i < len && i < (int)sizeof(key); i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    snprintf(buf, size, "%s/%016llx.pcm", dir, (unsigned long long)hash);
+    return 0;
+}
+
+float *decode_wav(const char *path, unsigned int *rate, int *frames) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = size > 12 ? malloc(size) : NULL;
+    if (!data || fread(data, 1, size, file) != (size_t)size ||
+        memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    // Walk the chunks for the format and the samples
+    WavFormat wav;
+    int have_format = 0;
+    const unsigned char *samples = NULL;
+    long sample_bytes = 0;
+    long pos = 12;
+    while (pos + 8 <= size) {
+        const unsigned char *chunk = data + pos;
+        long chunk_size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (long)chunk[7] << 24;
+        if (chunk_size > size - pos - 8) chunk_size = size - pos - 8;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            have_format = parse_wav_format(&wav, chunk, chunk_size) == 0;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            samples = chunk + 8;
+            sample_bytes = chunk_size;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    if (!samples || !have_format) {
+        free(data);
+        return NULL;
+    }
+    int bytes = wav.bits / 8;
+    int channels = wav.channels;
+    *rate = wav.rate;
+
+    // Decode to float and fold all channels down to mono
+    *frames = (int)(sample_bytes / (bytes * channels));
+    float *output = malloc((*frames > 0 ? *frames : 1) * sizeof(float));
+    if (!output) {
+        free(data);
+        return NULL;
+    }
+    for (int i = 0; i < *frames; i++) {
+        double sum = 0.0;
+        for (int c = 0; c < channels; c++) {
+            sum += wav_sample(&wav, samples + ((long)i * channels + c) * bytes);
+        }
+        output[i] = (float)(sum / channels);
+    }
+
+    free(data);
+    return output;
+}
+
+int parse_wav_format(WavFormat *wav, const unsigned char *chunk, long chunk_size) {
+    if (chunk_size < 16) return -1;
+    wav->format = chunk[8] | chunk[9] << 8;
+    wav->channels = chunk[10] | chunk[11] << 8;
+    wav->rate = chunk[12] | chunk[13] << 8 | chunk[14] << 16 | (unsigned int)chunk[15] << 24;
+    wav->bits = chunk[22] | chunk[23] << 8;
+    // WAVE_FORMAT_EXTENSIBLE keeps the real format in its sub-format GUID
+    if (wav->format == 0xFFFE && chunk_size >= 40) {
+        wav->format = chunk[32] | chunk[33] << 8;
+    }
+
+    int bytes = wav->bits / 8;
+    int supported = (wav->format == 1 && bytes >= 1 && bytes <= 4) ||
+                    (wav->format == 3 && (wav->bits == 32 || wav->bits == 64));
+    if (wav->channels < 1 || wav->rate == 0 || !supported) return -1;
+    return 0;
+}
+
+double wav_sample(const WavFormat *wav, const unsigned char *p) {
+    int bytes = wav->bits / 8;
+    if (wav->format == 3 && bytes == 4) {
+        float f;
+        memcpy(&f, p, sizeof(f));
+        return f;
+    } else if (wav->format == 3) {
+        double d;
+        memcpy(&d, p, sizeof(d));
+        return d;
+    } else if (bytes == 1) {
+        return (p[0] - 128) / 128.0;
+    } else if (bytes == 2) {
+        return (int16_t)(p[0] | p[1] << 8) / 32768.0;
+    } else if (bytes == 3) {
+        int32_t v = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+        return (v >> 8) / 8388608.0;
+    }
+    int32_t v = (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    return v / 2147483648.0;
+}
+
+short *resample_to_s16(const float *input, int input_frames, unsigned int input_rate,
+                       unsigned int output_rate, int *output_frames) {
+    *output_frames = (int)((int64_t)input_frames * output_rate / input_rate);
+    short *output = malloc((*output_frames > 0 ? *output_frames : 1) * sizeof(short));
+    if (!output) return NULL;
+
+    // Windowed-sinc (Lanczos) interpolation, low-passed when downsampling.
+    // It only ever runs once per sample and device rate, so quality wins.
+    const int lobes = 8;
+    double step = (double)input_rate / output_rate;
+    double cutoff = step > 1.0 ? 1.0 / step : 1.0;
+    double half_width = lobes / cutoff;
+    for (int i = 0; i < *output_frames; i++) {
+        double value;
+        double center = i * step;
+        if (input_rate == output_rate) {
+            value = input[i];
+        } else {
+            double sum = 0.0;
+            int first = (int)ceil(center - half_width);
+            int last = (int)floor(center + half_width);
+            if (first < 0) first = 0;
+            if (last >= input_frames) last = input_frames - 1;
+            for (int j = first; j <= last; j++) {
+                double x = (j - center) * cutoff;
+                double weight = cutoff;
+                if (x != 0.0) {
+                    weight *= sin(M_PI * x) / (M_PI * x) * sin(M_PI * x / lobes) / (M_PI * x / lobes);
+                }
+                sum += input[j] * weight;
+            }
+            value = sum;
+        }
+        if (value > 1.0) value = 1.0;
+        if (value < -1.0) value = -1.0;
+        output[i] = (short)lrint(value * 32767.0);
+    }
+    return output;
+}
+
+void free_cue(Cue *cue) {
+    if (cue->map) {
+        munmap(cue->map, cue->map_size);
+    } else {
+        free(cue->samples);
+    }
+    memset(cue, 0, sizeof(*cue));
+}
+
+void generate_tone(Cue *cue, double frequency, double seconds, double level, double ramp_seconds) {
+    unsigned int rate = audio_engine.rate;
+    cue->frames = (int)(seconds * rate);
+    cue->samples = malloc(cue->frames * sizeof(short));
+    if (!cue->samples) {
+        cue->frames = 0;
+        return;
+    }
+
+    int ramp = (int)(ramp_seconds * rate);
+    for (int i = 0; i < cue->frames; i++) {
+        double gain = 1.0;
+        if (i < ramp) gain = (double)i / ramp;
+        if (cue->frames - i < ramp) gain = (double)(cue->frames - i) / ramp;
+        cue->samples[i] = (short)(sin(2.0 * M_PI * frequency * i / rate) * 32767.0 * gain);
+    }
+    // Stored at full scale; the mixer applies the level
+    cue->gain = (float)level;
+}
+
+void audio_schedule(int cue, int64_t target_ns, int tag, int sync) {
+    if (!audio_engine.started) return;
+
+    pthread_mutex_lock(&audio_engine.lock);
+    if (add_voice(cue, target_ns, tag, sync) < 0) {
+        stats.voices_dropped++; // Every voice busy; counted rather than lost quietly
+    }
+    pthread_cond_signal(&audio_engine.wake);
+    pthread_mutex_unlock(&audio_engine.lock);
+}
+
+// Caller holds audio_engine.lock
+int add_voice(int cue, int64_t target_ns, int tag, int sync) {
+    for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+        Voice *voice = &audio_engine.voices[i];
+        if (voice->active) continue;
+        voice->active = 1;
+        voice->cue = &audio_engine.cues[cue];
+        voice->target_ns = target_ns;
+        voice->start_frame = -1;
+        voice->tag = tag;
+        voice->sync = sync;
+        voice->measured = 0;
+        if (sync) audio_engine.sync_onset_ns = 0;
+        return 0;
+    }
+    return -1;
+}
+
+void audio_set_cadence(int64_t start_ns, int64_t end_ns, int bpm) {
+    if (!audio_engine.started) return;
+
+    pthread_mutex_lock(&audio_engine.lock);
+    audio_engine.cadence_bpm = bpm;
+    audio_engine.cadence_start_ns = start_ns;
+    audio_engine.cadence_end_ns = end_ns;
+    audio_engine.cadence_next = 0;
+    // Picking up part way, e.g. after a pause, starts at the next beat
+    int64_t now = monotonic_ns();
+    if (bpm > 0 && now > start_ns) {
+        int64_t beat_ns = 60 * NSEC_PER_SEC / bpm;
+        audio_engine.cadence_next = (now - start_ns + beat_ns - 1) / beat_ns;
+    }
+    pthread_cond_signal(&audio_engine.wake);
+    pthread_mutex_unlock(&audio_engine.lock);
+}
+
+// Caller holds audio_engine.lock. Clicks become ordinary voices a little
+// ahead of time, so they are placed and measured like any other cue.
+void schedule_cadence(int64_t now) {
+    while (audio_engine.cadence_bpm > 0) {
+        int64_t beat_ns = audio_engine.cadence_start_ns +
+                          audio_engine.cadence_next * 60 * NSEC_PER_SEC / audio_engine.cadence_bpm;
+        if (beat_ns >= audio_engine.cadence_end_ns) {
+            audio_engine.cadence_bpm = 0;
+            break;
+        }
+        if (beat_ns > now + AUDIO_WAKE_AHEAD_NS) break;
+        if (add_voice(CUE_CLICK, beat_ns, TAG_CADENCE, 0) < 0) break;
+        audio_engine.cadence_next++;
+    }
+}
+
+void audio_cancel(int tag) {
+    if (!audio_engine.started) return;
+
+    // A negative tag cancels everything
+    pthread_mutex_lock(&audio_engine.lock);
+    for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+        if (tag < 0 || audio_engine.voices[i].tag == tag) {
+            audio_engine.voices[i].active = 0;
+        }
+    }
+    if (tag < 0 || tag == TAG_CADENCE) {
+        audio_engine.cadence_bpm = 0;
+    }
+    pthread_mutex_unlock(&audio_engine.lock);
+}
+
+void audio_set_paused(int paused) {
+    if (!audio_engine.started) return;
+
+    pthread_mutex_lock(&audio_engine.lock);
+    audio_engine.paused = paused;
+    pthread_cond_signal(&audio_engine.wake);
+    pthread_mutex_unlock(&audio_engine.lock);
+}
+
+int64_t audio_latency_ns() {
+    // A running stream can take a new voice in its next period
+    pthread_mutex_lock(&audio_engine.lock);
+    int64_t period_ns = (int64_t)audio_engine.period_frames * NSEC_PER_SEC / audio_engine.rate;
+    int64_t buffer_ns = (int64_t)audio_engine.buffer_frames * NSEC_PER_SEC / audio_engine.rate;
+    int64_t delay_ns = audio_engine.output_delay_ns;
+    pthread_mutex_unlock(&audio_engine.lock);
+    if (delay_ns > 0) {
+        return delay_ns + 2 * period_ns;
+    }
+
+    // Worst case from a stopped stream: one period to start plus a full buffer
+    return buffer_ns + period_ns;
+}
+
+void *audio_thread_main(void *arg) {
+    (void)arg;
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+    int64_t last_period_ns = 0;
+
+    pthread_mutex_lock(&audio_engine.lock);
+    while (audio_engine.running) {
+        // Find out how soon the stream is needed
+        int64_t now = monotonic_ns();
+        int64_t due = INT64_MAX;
+        schedule_cadence(now);
+        for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+            Voice *voice = &audio_engine.voices[i];
+            if (!voice->active) continue;
+            int64_t t = voice->start_frame >= 0 ? now : voice->target_ns;
+            if (t < due) due = t;
+        }
+        // Keep the stream open between clicks rather than restarting it each beat
+        int music_playing = __atomic_load_n(&music.playing, __ATOMIC_ACQUIRE);
+        if ((music_playing && !audio_engine.paused) || audio_engine.cadence_bpm > 0) due = now;
+
+        if (due > now + AUDIO_WAKE_AHEAD_NS) {
+            if (audio_engine.stream_active) {
+                // Let the tail of the last cue play out, then stop the device
+                pthread_mutex_unlock(&audio_engine.lock);
+                snd_pcm_drain(audio_handle);
+                pthread_mutex_lock(&audio_engine.lock);
+                audio_engine.stream_active = 0;
+                audio_engine.output_delay_ns = 0;
+
+                // Underruns mean this period is too small for the machine;
+                // settle on a larger one while nothing is playing
+                if (audio_engine.stream_underruns >= 2 &&
+                    audio_engine.period_frames * 2 <= AUDIO_MAX_PERIOD_FRAMES) {
+                    int previous = audio_engine.period_target;
+                    audio_engine.period_target = audio_engine.period_frames * 2;
+                    if (negotiate_audio(audio_engine.rate) == 0) {
+                        print_audio_config("Audio: underruns, now ");
+                    } else {
+                        audio_engine.period_target = previous;
+                        negotiate_audio(audio_engine.rate);
+                    }
+                }
+            } else if (due == INT64_MAX) {
+                pthread_cond_wait(&audio_engine.wake, &audio_engine.lock);
+            } else {
+                struct timespec ts;
+                int64_t wake_ns = due - AUDIO_WAKE_AHEAD_NS;
+                ts.tv_sec = wake_ns / NSEC_PER_SEC;
+                ts.tv_nsec = wake_ns % NSEC_PER_SEC;
+                pthread_cond_timedwait(&audio_engine.wake, &audio_engine.lock, &ts);
+            }
+            continue;
+        }
+
+        pthread_mutex_unlock(&audio_engine.lock);
+        if (!audio_engine.stream_active) {
+            snd_pcm_prepare(audio_handle);
+            audio_engine.stream_underruns = 0;
+            last_period_ns = 0;
+        }
+
+        // A running stream paces us; any deviation from one period per
+        // wakeup is scheduling delay eating into the buffer
+        int64_t woke_ns = monotonic_ns();
+        metric_add(&thread_metrics[THREAD_AUDIO].wakeups, 1);
+        if (last_period_ns > 0) {
+            int64_t period_ns = (int64_t)audio_engine.period_frames * NSEC_PER_SEC / audio_engine.rate;
+            double jitter_us = llabs(woke_ns - last_period_ns - period_ns) / 1000.0;
+            stats.audio_periods++;
+            stats.audio_jitter_sum_us += jitter_us;
+            if (jitter_us > stats.audio_jitter_max_us) stats.audio_jitter_max_us = jitter_us;
+        }
+        last_period_ns = woke_ns;
+
+        // The next frame we write is heard once everything queued ahead of
+        // it has played. While running, the status timestamp says when that
+        // delay was sampled, which is closer to the hardware than our clock.
+        snd_pcm_sframes_t delay = 0;
+        int64_t sampled_ns = monotonic_ns();
+        if (snd_pcm_status(audio_handle, status) == 0) {
+            delay = snd_pcm_status_get_delay(status);
+            if (snd_pcm_status_get_state(status) == SND_PCM_STATE_RUNNING) {
+                snd_htimestamp_t htstamp;
+                snd_pcm_status_get_htstamp(status, &htstamp);
+                int64_t htstamp_ns = htstamp.tv_sec * NSEC_PER_SEC + htstamp.tv_nsec;
+                if (htstamp_ns > 0 && htstamp_ns <= sampled_ns) {
+                    sampled_ns = htstamp_ns;
+                }
+            }
+        }
+        if (delay < 0) delay = 0;
+        int64_t delay_ns = (int64_t)delay * NSEC_PER_SEC / audio_engine.rate;
+        int64_t heard_ns = sampled_ns + delay_ns;
+
+        pthread_mutex_lock(&audio_engine.lock);
+        audio_engine.stream_active = 1;
+        audio_engine.output_delay_ns = delay_ns;
+        mix_period(heard_ns);
+        pthread_mutex_unlock(&audio_engine.lock);
+
+        write_period();
+
+        pthread_mutex_lock(&audio_engine.lock);
+        audio_engine.written_frames += audio_engine.period_frames;
+    }
+
+    if (audio_engine.stream_active) {
+        snd_pcm_drop(audio_handle);
+        audio_engine.stream_active = 0;
+    }
+    pthread_mutex_unlock(&audio_engine.lock);
+    return NULL;
+}
+
+void mix_period(int64_t heard_ns) {
+    int64_t written = audio_engine.written_frames;
+    int64_t rate = audio_engine.rate;
+    int period = audio_engine.period_frames;
+    memset(audio_engine.mix, 0, period * sizeof(float));
+
+    for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+        Voice *voice = &audio_engine.voices[i];
+        if (!voice->active) continue;
+
+        // Now that its first sample has reached the device, check when it
+        // will actually be heard against when it was meant to be
+        if (voice->start_frame >= 0 && !voice->measured && voice->start_frame < written) {
+            int64_t onset_ns = heard_ns - (written - voice->start_frame) * NSEC_PER_SEC / rate;
+            double error_us = fabs((double)(onset_ns - voice->target_ns)) / 1000.0;
+            stats.onset_count++;
+            stats.onset_error_sum_us += error_us;
+            if (error_us > stats.onset_error_max_us) stats.onset_error_max_us = error_us;
+            if (voice->sync) audio_engine.sync_onset_ns = onset_ns;
+            voice->measured = 1;
+        }
+
+        // Place the voice at the sample matching its target time
+        if (voice->start_frame < 0) {
+            int64_t offset = ((voice->target_ns - heard_ns) * rate + NSEC_PER_SEC / 2) / NSEC_PER_SEC;
+            if (offset >= period) continue;
+            if (offset < 0) offset = 0; // Too late already, play as soon as possible
+            voice->start_frame = written + offset;
+        }
+
+        int64_t begin = voice->start_frame - written;
+        int src = begin < 0 ? (int)-begin : 0;
+        int dst = begin < 0 ? 0 : (int)begin;
+        int count = voice->cue->frames - src;
+        if (count > period - dst) count = period - dst;
+        if (count > 0) {
+            mixer->mix(audio_engine.mix + dst, voice->cue->samples + src, count,
+                       voice->cue->gain * master_volume);
+        }
+
+        // Keep finished voices until their onset has been measured
+        if (src + count >= voice->cue->frames && voice->measured) {
+            voice->active = 0;
+        }
+    }
+
+    if (__atomic_load_n(&music.playing, __ATOMIC_ACQUIRE) && !audio_engine.paused) {
+        mix_music(heard_ns);
+    }
+
+    // Overlapping cues can sum past full scale; turn them down rather
+    // than clipping
+    float release = (float)((double)period * NSEC_PER_SEC / audio_engine.rate / LIMITER_RELEASE_NS);
+    audio_engine.limiter_gain = limit_mix(mixer, audio_engine.mix, period, audio_engine.limiter_gain, release);
+
+    // Convert to the device format, copying mono to every channel
+    int channels = audio_engine.channels;
+    if (audio_engine.format == SND_PCM_FORMAT_S16_LE) {
+        short *out = audio_engine.output;
+        for (int n = 0; n < period; n++) {
+            short sample = (short)lrintf(audio_engine.mix[n] * 32767.0f);
+            for (int c = 0; c < channels; c++) out[n * channels + c] = sample;
+        }
+    } else if (audio_engine.format == SND_PCM_FORMAT_S32_LE) {
+        int32_t *out = audio_engine.output;
+        for (int n = 0; n < period; n++) {
+            int32_t sample = (int32_t)lrint(audio_engine.mix[n] * 2147483647.0);
+            for (int c = 0; c < channels; c++) out[n * channels + c] = sample;
+        }
+    } else {
+        float *out = audio_engine.output;
+        for (int n = 0; n < period; n++) {
+            for (int c = 0; c < channels; c++) out[n * channels + c] = audio_engine.mix[n];
+        }
+    }
+}
+
+void mix_music(int64_t heard_ns) {
+    int period = audio_engine.period_frames;
+    int64_t period_ns = (int64_t)period * NSEC_PER_SEC / audio_engine.rate;
+
+    // Duck while a cue is sounding or about to, easing in and out so the
+    // music doesn't pump. Cadence clicks play along with the music instead.
+    float target = 1.0f;
+    for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+        const Voice *voice = &audio_engine.voices[i];
+        if (voice->active && voice->tag != TAG_CADENCE && voice->target_ns <= heard_ns + period_ns + MUSIC_DUCK_LEAD_NS) {
+            target = MUSIC_DUCK_LEVEL;
+            break;
+        }
+    }
+    int64_t time_constant = target < music.gain ? MUSIC_ATTACK_NS : MUSIC_RELEASE_NS;
+    float step = (float)period_ns / time_constant;
+    music.gain += (target - music.gain) * (step < 1.0f ? step : 1.0f);
+    float gain = music.gain * music_volume * master_volume;
+
+    int done = 0;
+    while (done < period) {
+        pthread_mutex_lock(&music.lock);
+        int ready = music.ready[music.play_block];
+        pthread_mutex_unlock(&music.lock);
+        if (!ready) {
+            // The reader fell behind; leave the music out rather than wait
+            stats.music_dropouts++;
+            metric_add(&thread_metrics[THREAD_AUDIO].music_dropouts, 1);
+            break;
+        }
+
+        int count = music.block_frames - music.play_pos;
+        if (count > period - done) count = period - done;
+        mixer->mix(audio_engine.mix + done, music.blocks[music.play_block] + music.play_pos, count, gain);
+        music.play_pos += count;
+        done += count;
+
+        if (music.play_pos >= music.block_frames) {
+            pthread_mutex_lock(&music.lock);
+            music.ready[music.play_block] = 0;
+            pthread_cond_signal(&music.wake);
+            pthread_mutex_unlock(&music.lock);
+            music.play_block ^= 1;
+            music.play_pos = 0;
+        }
+    }
+}
+
+void setup_mixer() {
+    mixers[MIXER_SCALAR] = (Mixer){"scalar", mix_scalar, peak_scalar, 1};
+    mixers[MIXER_SSE2] = (Mixer){"sse2", mix_sse2, peak_sse2, 0};
+    mixers[MIXER_AVX2] = (Mixer){"avx2", mix_avx2, peak_avx2, 0};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    mixers[MIXER_SSE2].supported = __builtin_cpu_supports("sse2");
+    mixers[MIXER_AVX2].supported = __builtin_cpu_supports("avx2");
+#endif
+    mixer = &mixers[MIXER_SCALAR];
+    for (int i = 0; i < MIXER_COUNT; i++) {
+        if (mixers[i].supported) mixer = &mixers[i];
+    }
+}
+
+void mix_scalar(float *mix, const short *samples, int count, float gain) {
+    float scale = gain / 32768.0f;
+    for (int n = 0; n < count; n++) {
+        mix[n] += samples[n] * scale;
+    }
+}
+
+float peak_scalar(const float *mix, int count) {
+    float peak = 0.0f;
+    for (int n = 0; n < count; n++) {
+        float level = fabsf(mix[n]);
+        if (level > peak) peak = level;
+    }
+    return peak;
+}
+
+// Gain envelope over whole periods: one that would clip is turned down at
+// once, just enough, and the gain then recovers over LIMITER_RELEASE_NS
+// (release is the share of that one period covers). A mix that doesn't
+// clip, such as any cue on its own, passes through untouched.
+float limit_mix(const Mixer *m, float *mix, int count, float gain, float release) {
+    float peak = m->peak(mix, count);
+    float target = peak > 1.0f ? 1.0f / peak : 1.0f;
+    if (gain >= 1.0f && target >= 1.0f) return 1.0f;
+
+    // Ramp across the period when recovering, never above what this one allows
+    float from = gain < target ? gain : target;
+    float to = from;
+    if (gain < target) {
+        to = gain + (1.0f - gain) * (release < 1.0f ? release : 1.0f);
+        if (to > target) to = target;
+    }
+    float step = (to - from) / count;
+    for (int n = 0; n < count; n++) {
+        mix[n] *= from + step * n;
+    }
+    return to > 0.9999f ? 1.0f : to;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void mix_sse2(float *mix, const short *samples, int count, float gain) {
+    __m128 scale = _mm_set1_ps(gain / 32768.0f);
+    int n = 0;
+    for (; n + 8 <= count; n += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(samples + n));
+        // Sign-extend each half to 32 bits by shifting down from the top
+        __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        _mm_storeu_ps(mix + n, _mm_add_ps(_mm_loadu_ps(mix + n), _mm_mul_ps(lo, scale)));
+        _mm_storeu_ps(mix + n + 4, _mm_add_ps(_mm_loadu_ps(mix + n + 4), _mm_mul_ps(hi, scale)));
+    }
+    mix_scalar(mix + n, samples + n, count - n, gain);
+}
+
+__attribute__((target("sse2")))
+float peak_sse2(const float *mix, int count) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 peak = _mm_setzero_ps();
+    int n = 0;
+    for (; n + 4 <= count; n += 4) {
+        peak = _mm_max_ps(peak, _mm_andnot_ps(sign, _mm_loadu_ps(mix + n)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, peak);
+    float rest = peak_scalar(mix + n, count - n);
+    for (int i = 0; i < 4; i++) {
+        if (lanes[i] > rest) rest = lanes[i];
+    }
+    return rest;
+}
+
+__attribute__((target("avx2")))
+void mix_avx2(float *mix, const short *samples, int count, float gain) {
+    __m256 scale = _mm256_set1_ps(gain / 32768.0f);
+    int n = 0;
+    for (; n + 16 <= count; n += 16) {
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(samples + n))));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(samples + n + 8))));
+        _mm256_storeu_ps(mix + n, _mm256_add_ps(_mm256_loadu_ps(mix + n), _mm256_mul_ps(lo, scale)));
+        _mm256_storeu_ps(mix + n + 8, _mm256_add_ps(_mm256_loadu_ps(mix + n + 8), _mm256_mul_ps(hi, scale)));
+    }
+    mix_scalar(mix + n, samples + n, count - n, gain);
+}
+
+__attribute__((target("avx2")))
+float peak_avx2(const float *mix, int count) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 peak = _mm256_setzero_ps();
+    int n = 0;
+    for (; n + 8 <= count; n += 8) {
+        peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, _mm256_loadu_ps(mix + n)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, peak);
+    float rest = peak_scalar(mix + n, count - n);
+    for (int i = 0; i < 8; i++) {
+        if (lanes[i] > rest) rest = lanes[i];
+    }
+    return rest;
+}
+#else
+void mix_sse2(float *mix, const short *samples, int count, float gain) {
+    mix_scalar(mix, samples, count, gain);
+}
+
+float peak_sse2(const float *mix, int count) {
+    return peak_scalar(mix, count);
+}
+
+void mix_avx2(float *mix, const short *samples, int count, float gain) {
+    mix_scalar(mix, samples, count, gain);
+}
+
+float peak_avx2(const float *mix, int count) {
+    return peak_scalar(mix, count);
+}
+#endif
+
+void bench_mixer() {
+    static const int voice_counts[] = {1, 4, 8, 16, AUDIO_MAX_VOICES};
+    int runs = sizeof(voice_counts) / sizeof(voice_counts[0]);
+
+    // One second of tone gives each voice its own stretch to read from
+    Cue cue;
+    memset(&cue, 0, sizeof(cue));
+    audio_engine.rate = 48000;
+    generate_tone(&cue, 440.0, 1.0, 0.5, 0.005);
+    float *mix = malloc(BENCH_PERIOD_FRAMES * sizeof(float));
+    if (!cue.samples || !mix) {
+        printf("Error: Cannot allocate benchmark buffers\n");
+        free(cue.samples);
+        free(mix);
+        return;
+    }
+    int spans = cue.frames - BENCH_PERIOD_FRAMES;
+
+    printf("Mixer throughput, %d-frame periods, million voice-frames per second\n", BENCH_PERIOD_FRAMES);
+    printf("%-8s", "voices");
+    for (int r = 0; r < runs; r++) printf("%10d", voice_counts[r]);
+    printf("%10s\n", "limiter");
+
+    for (int i = 0; i < MIXER_COUNT; i++) {
+        const Mixer *m = &mixers[i];
+        if (!m->supported) {
+            printf("%-8s  not supported by this CPU\n", m->name);
+            continue;
+        }
+        printf("%-8s", m->name);
+        for (int r = 0; r <= runs; r++) {
+            int voices = r < runs ? voice_counts[r] : 0;
+            long periods = 0;
+            int64_t start = monotonic_ns();
+            int64_t elapsed;
+            do {
+                for (int k = 0; k < 64; k++, periods++) {
+                    if (voices == 0) {
+                        // Every period clips, the limiter's slow path
+                        for (int n = 0; n < BENCH_PERIOD_FRAMES; n++) mix[n] = (n & 1) ? 1.5f : -1.5f;
+                        limit_mix(m, mix, BENCH_PERIOD_FRAMES, 0.5f, 0.1f);
+                        continue;
+                    }
+                    memset(mix, 0, BENCH_PERIOD_FRAMES * sizeof(float));
+                    for (int v = 0; v < voices; v++) {
+                        int offset = (int)((periods * BENCH_PERIOD_FRAMES + v * 997L) % spans);
+                        m->mix(mix, cue.samples + offset, BENCH_PERIOD_FRAMES, cue.gain);
+                    }
+                }
+                elapsed = monotonic_ns() - start;
+            } while (elapsed < (int64_t)(BENCH_SECONDS * NSEC_PER_SEC));
+            double frames = (double)periods * BENCH_PERIOD_FRAMES * (voices > 0 ? voices : 1);
+            printf("%10.0f", frames / (elapsed / 1e9) / 1e6);
+        }
+        printf("\n");
+    }
+    printf("Using %s\n", mixer->name);
+
+    free(cue.samples);
+    free(mix);
+}
+
+void setup_music(const char *filename) {
+    // A .wav is played on its own, anything else is a playlist of them
+    const char *ext = strrchr(filename, '.');
+    if (ext && strcasecmp(ext, ".wav") == 0) {
+        music.tracks = malloc(sizeof(char *));
+        if (music.tracks && (music.tracks[0] = strdup(filename))) music.track_count = 1;
+    } else {
+        FILE *file = fopen(filename, "r");
+        if (!file) {
+            printf("Warning: Cannot open playlist %s\n", filename);
+            return;
+        }
+
+        // Track paths are relative to the playlist, as in an .m3u
+        char base[MAX_PATH_LENGTH];
+        strncpy(base, filename, sizeof(base) - 1);
+        base[sizeof(base) - 1] = '\0';
+        char *slash = strrchr(base, '/');
+        if (slash) {
+            slash[1] = '\0';
+        } else {
+            base[0] = '\0';
+        }
+
+        char line[MAX_PATH_LENGTH];
+        int capacity = 0;
+        while (fgets(line, sizeof(line), file)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '#' || line[0] == '\0') continue;
+
+            char path[MAX_PATH_LENGTH * 2];
+            snprintf(path, sizeof(path), "%s%s", line[0] == '/' ? "" : base, line);
+            if (music.track_count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                char **tracks = realloc(music.tracks, capacity * sizeof(char *));
+                if (!tracks) break;
+                music.tracks = tracks;
+            }
+            music.tracks[music.track_count] = strdup(path);
+            if (music.tracks[music.track_count]) music.track_count++;
+        }
+        fclose(file);
+    }
+    if (music.track_count == 0) {
+        printf("Warning: No music tracks in %s\n", filename);
+        cleanup_music();
+        return;
+    }
+
+    // Half a second per block keeps disk reads rare and cheap
+    music.block_frames = audio_engine.rate / 2;
+    music.blocks[0] = malloc(music.block_frames * sizeof(short));
+    music.blocks[1] = malloc(music.block_frames * sizeof(short));
+    if (!music.blocks[0] || !music.blocks[1]) {
+        cleanup_music();
+        return;
+    }
+    music.track = -1;
+    music.phase = 1.0;  // Read the first source sample before any output
+    music.gain = 1.0f;
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&music.wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&music.lock, NULL);
+
+    music.running = 1;
+    // Disk reads may block, so the reader never runs at real-time priority
+    if (start_thread(&music.thread, music_thread_main, 0, "music") != 0) {
+        printf("Warning: Cannot start music thread\n");
+        cleanup_music();
+        return;
+    }
+    music.started = 1;
+    printf("Music: %d track%s\n", music.track_count, music.track_count == 1 ? "" : "s");
+}
+
+void cleanup_music() {
+    if (music.started) {
+        pthread_mutex_lock(&music.lock);
+        music.running = 0;
+        pthread_cond_signal(&music.wake);
+        pthread_mutex_unlock(&music.lock);
+        pthread_join(music.thread, NULL);
+    }
+    if (music.file) fclose(music.file);
+    for (int i = 0; i < music.track_count; i++) {
+        free(music.tracks[i]);
+    }
+    free(music.tracks);
+    free(music.raw);
+    free(music.blocks[0]);
+    free(music.blocks[1]);
+    memset(&music, 0, sizeof(music));
+}
+
+void *music_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&music.lock);
+    while (music.running) {
+        if (music.ready[music.fill_block]) {
+            pthread_cond_wait(&music.wake, &music.lock);
+            metric_add(&thread_metrics[THREAD_MUSIC].wakeups, 1);
+            continue;
+        }
+        pthread_mutex_unlock(&music.lock);
+
+        // The audio thread never touches a block that isn't ready, so
+        // decoding into it needs no lock
+        short *block = music.blocks[music.fill_block];
+        fill_music_block(block);
+
+        pthread_mutex_lock(&music.lock);
+        if (music.track_count == 0) break;
+        music.ready[music.fill_block] = 1;
+        music.fill_block ^= 1;
+        if (!music.playing) {
+            // First block is in; get the audio thread to open the stream
+            __atomic_store_n(&music.playing, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&music.lock);
+            pthread_mutex_lock(&audio_engine.lock);
+            pthread_cond_signal(&audio_engine.wake);
+            pthread_mutex_unlock(&audio_engine.lock);
+            pthread_mutex_lock(&music.lock);
+        }
+    }
+    __atomic_store_n(&music.playing, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&music.lock);
+    return NULL;
+}
+
+void fill_music_block(short *block) {
+    // Linear interpolation is plenty for background music and, unlike the
+    // cue resampler, works on a stream
+    for (int i = 0; i < music.block_frames; i++) {
+        while (music.phase >= 1.0) {
+            music.previous = music.next;
+            if (!music_read_sample(&music.next)) {
+                memset(block + i, 0, (music.block_frames - i) * sizeof(short));
+                return;
+            }
+            music.phase -= 1.0;
+        }
+        float value = music.previous + (music.next - music.previous) * (float)music.phase;
+        if (value > 1.0f) value = 1.0f;
+        if (value < -1.0f) value = -1.0f;
+        block[i] = (short)lrintf(value * 32767.0f);
+        music.phase += music.step;
+    }
+}
+
+int music_read_sample(float *value) {
+    while (music.raw_pos >= music.raw_frames) {
+        int frame_bytes = music.wav.bits / 8 * music.wav.channels;
+        if (music.file && music.data_left >= frame_bytes) {
+            long want = (long)MUSIC_READ_FRAMES * frame_bytes;
+            if (want > music.data_left) want = music.data_left;
+            size_t got = fread(music.raw, 1, want, music.file);
+            music.data_left -= (long)got;
+            music.raw_frames = (int)(got / frame_bytes);
+            music.raw_pos = 0;
+            if (music.raw_frames > 0) break;
+            music.data_left = 0;
+        }
+        // End of this track, carry on with the next and loop the playlist
+        if (music_open_track() < 0) return 0;
+    }
+
+    int bytes = music.wav.bits / 8;
+    const unsigned char *frame = music.raw + (long)music.raw_pos * bytes * music.wav.channels;
+    double sum = 0.0;
+    for (int c = 0; c < music.wav.channels; c++) {
+        sum += wav_sample(&music.wav, frame + c * bytes);
+    }
+    *value = (float)(sum / music.wav.channels);
+    music.raw_pos++;
+    return 1;
+}
+
+int music_open_track() {
+    if (music.file) {
+        fclose(music.file);
+        music.file = NULL;
+    }
+
+    while (music.track_count > 0) {
+        music.track = (music.track + 1) % music.track_count;
+        const char *path = music.tracks[music.track];
+        FILE *file = fopen(path, "rb");
+        unsigned char header[12];
+        int ok = file && fread(header, 1, 12, file) == 12 &&
+                 memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WAVE", 4) == 0;
+
+        // Read chunk headers until the samples, skipping everything else
+        int have_format = 0;
+        long data_size = -1;
+        while (ok && data_size < 0) {
+            unsigned char chunk[48];
+            if (fread(chunk, 1, 8, file) != 8) break;
+            long chunk_size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (long)chunk[7] << 24;
+            if (memcmp(chunk, "data", 4) == 0) {
+                data_size = chunk_size;
+            } else if (memcmp(chunk, "fmt ", 4) == 0) {
+                long used = chunk_size < 40 ? chunk_size : 40;
+                ok = fread(chunk + 8, 1, used, file) == (size_t)used &&
+                     fseek(file, chunk_size - used + (chunk_size & 1), SEEK_CUR) == 0;
+                have_format = ok && parse_wav_format(&music.wav, chunk, used) == 0;
+            } else {
+                ok = fseek(file, chunk_size + (chunk_size & 1), SEEK_CUR) == 0;
+            }
+        }
+
+        unsigned char *raw = NULL;
+        if (ok && have_format && data_size > 0) {
+            raw = realloc(music.raw, (size_t)MUSIC_READ_FRAMES * music.wav.bits / 8 * music.wav.channels);
+        }
+        if (raw) {
+            music.raw = raw;
+            music.file = file;
+            music.data_left = data_size;
+            music.raw_frames = 0;
+            music.raw_pos = 0;
+            music.step = (double)music.wav.rate / audio_engine.rate;
+            return 0;
+        }
+
+        // Drop tracks that can't be played so a bad entry isn't retried every loop
+        printf("Warning: Cannot play music track %s\n", path);
+        if (file) fclose(file);
+        free(music.tracks[music.track]);
+        memmove(music.tracks + music.track, music.tracks + music.track + 1,
+                (music.track_count - music.track - 1) * sizeof(char *));
+        music.track_count--;
+        music.track--;
+    }
+    return -1;
+}
+
+void write_period() {
+    int period = audio_engine.period_frames;
+    int frame_bytes = audio_engine.channels * (audio_engine.format == SND_PCM_FORMAT_S16_LE ? 2 : 4);
+    int offset = 0;
+    while (offset < period) {
+        snd_pcm_sframes_t frames = snd_pcm_writei(audio_handle, (char *)audio_engine.output + offset * frame_bytes,
+                                                  period - offset);
+        if (frames < 0) {
+            if (frames == -EPIPE) {
+                stats.audio_underruns++;
+                audio_engine.stream_underruns++;
+                metric_add(&thread_metrics[THREAD_AUDIO].audio_underruns, 1);
+            }
+            // Try to recover from error
+            metric_add(&thread_metrics[THREAD_AUDIO].pcm_recoveries, 1);
+            if (snd_pcm_recover(audio_handle, frames, 1) < 0) {
+                return;
+            }
+            continue;
+        }
+        offset += frames;
+    }
+}
+
+void schedule_countdown(int64_t boundary_ns, int64_t duration_ns) {
+    if (countdown_pips <= 0) return;
+
+    // One pip as each of the last seconds appears, and a final one on the boundary
+    for (int k = countdown_pips; k >= 1; k--) {
+        if (k * NSEC_PER_SEC < duration_ns) {
+            audio_schedule(CUE_PIP, boundary_ns - k * NSEC_PER_SEC, TAG_COUNTDOWN, 0);
+        }
+    }
+    audio_schedule(CUE_FINAL_PIP, boundary_ns, TAG_COUNTDOWN, 1);
+}
+
+int64_t schedule_boundary_cues(int64_t boundary_ns, int64_t duration_ns) {
+    // Whatever sounds first on the boundary is what the flash lines up
+    // with, and the only sync voice: the final pip when counting down,
+    // otherwise the first beep
+    schedule_countdown(boundary_ns, duration_ns);
+    if (countdown_pips > 0 && audio_handle) {
+        return play_beep(boundary_ns + FINAL_PIP_GAP_NS, 0);
+    }
+    return play_beep(boundary_ns, 1);
+}
+
+void record_av_offset(int64_t visual_ns) {
+    if (!audio_engine.started || visual_ns == 0) return;
+
+    pthread_mutex_lock(&audio_engine.lock);
+    int64_t onset_ns = audio_engine.sync_onset_ns;
+    pthread_mutex_unlock(&audio_engine.lock);
+    if (onset_ns == 0) return;
+
+    double offset_us = (visual_ns - onset_ns) / 1000.0;
+    stats.av_count++;
+    stats.av_offset_sum_us += offset_us;
+    if (fabs(offset_us) > stats.av_offset_max_us) stats.av_offset_max_us = fabs(offset_us);
+}
+
+void draw_timer(const FrameState *state, int64_t now) {
+    if (!cr) return;
+    int64_t started = monotonic_ns();
+
+    // Round up so the full duration is shown first and 00:00 never is
+    int64_t remaining_ns = state->interval_end_ns - now;
+    int time_remaining = (int)((remaining_ns + NSEC_PER_SEC - 1) / NSEC_PER_SEC);
+
+    // Rebuild the static layer only when something in it changes
+    int waiting = state->phase == PHASE_WAITING;
+    int show_next = time_remaining <= 30 && state->interval + 1 < program_view.count && !waiting;
+    int banner = state->phase == PHASE_PAUSED ? BANNER_PAUSED : waiting ? BANNER_WAITING : BANNER_NONE;
+    if (render_cache.program_version != program_view.version) {
+        render_cache.base_valid = 0; // Edited, so the ticks have moved
+        render_cache.valid = 0;
+        render_cache.program_version = program_view.version;
+    }
+    int layout_changed = !render_cache.valid || render_cache.interval != state->interval ||
+                         render_cache.show_next != show_next || render_cache.banner != banner;
+    if (layout_changed) {
+        build_layout(state->interval, show_next, banner);
+    }
+
+    char time_str[16];
+    format_time(time_str, sizeof(time_str), remaining_ns);
+
+    // Both bars come from the published state alone, never from the program
+    double overall_progress, current_progress;
+    if (animate) {
+        // Interpolate from the clock so the bars glide instead of stepping
+        int64_t elapsed_ns = state->elapsed_before_ns + state->interval_ns - remaining_ns;
+        overall_progress = (double)elapsed_ns / state->session_ns;
+        current_progress = 1.0 - (double)remaining_ns / state->interval_ns;
+    } else {
+        int64_t shown_ns = time_remaining * NSEC_PER_SEC;
+        overall_progress = (double)(state->elapsed_before_ns + state->interval_ns - shown_ns) / state->session_ns;
+        current_progress = 1.0 - (double)shown_ns / state->interval_ns;
+    }
+    if (waiting) {
+        // The current bar fills up to the start; the overall one holds
+        overall_progress = (double)state->elapsed_before_ns / state->session_ns;
+    }
+    int overall_fill = (int)(render_cache.bar_width * overall_progress);
+    int current_fill = (int)(render_cache.bar_width * current_progress);
+
+    // Skip the frame if every pixel would come out the same
+    if (!layout_changed && strcmp(time_str, render_cache.drawn_time) == 0 &&
+        overall_fill == render_cache.overall_fill && current_fill == render_cache.current_fill) {
+        stats.frames_skipped++;
+        return;
+    }
+
+    // Only the clock cells and bar segments that changed are repainted
+    draw_clock_text(time_str);
+    update_bar_fill(render_cache.overall_y, &render_cache.overall_fill, overall_fill);
+    update_bar_fill(render_cache.current_y, &render_cache.current_fill, current_fill);
+
+    // Update display
+    flush_frame(started);
+}
+
+void setup_glyph_cache() {
+    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_font_size(cr, TIMER_FONT_SIZE);
+
+    cairo_font_extents_t font_extents;
+    cairo_font_extents(cr, &font_extents);
+    glyph_cache.ascent = (int)ceil(font_extents.ascent);
+    glyph_cache.height = glyph_cache.ascent + (int)ceil(font_extents.descent);
+
+    // Digits share the widest advance so the clock doesn't wobble as it counts
+    cairo_text_extents_t extents;
+    int digit_width = 0;
+    for (int i = 0; i < 10; i++) {
+        char ch[2] = { GLYPH_CHARS[i], '\0' };
+        cairo_text_extents(cr, ch, &extents);
+        if ((int)ceil(extents.x_advance) > digit_width) {
+            digit_width = (int)ceil(extents.x_advance);
+        }
+    }
+
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        char ch[2] = { GLYPH_CHARS[i], '\0' };
+        cairo_text_extents(cr, ch, &extents);
+        glyph_cache.width[i] = i < 10 ? digit_width : (int)ceil(extents.x_advance);
+
+        glyph_cache.glyph[i] = cairo_surface_create_similar(surface, CAIRO_CONTENT_COLOR_ALPHA,
+                                                            glyph_cache.width[i], glyph_cache.height);
+        cairo_t *gcr = cairo_create(glyph_cache.glyph[i]);
+        cairo_select_font_face(gcr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+        cairo_set_font_size(gcr, TIMER_FONT_SIZE);
+        cairo_set_source_rgb(gcr, 1.0, 1.0, 1.0); // White text
+        cairo_move_to(gcr, (glyph_cache.width[i] - extents.x_advance) / 2, glyph_cache.ascent);
+        cairo_show_text(gcr, ch);
+        cairo_destroy(gcr);
+    }
+    glyph_cache.valid = 1;
+}
+
+void build_base_layer() {
+    // Everything that stays the same for the whole session, so moving
+    // between intervals never redraws the ticks
+    if (!render_cache.base) {
+        render_cache.base = cairo_surface_create_similar(surface, CAIRO_CONTENT_COLOR_ALPHA,
+                                                         screen_width, screen_height);
+    }
+
+    cairo_t *bg = cairo_create(render_cache.base);
+
+    // Clear background
+    cairo_set_source_rgb(bg, 0.0, 0.0, 0.0); // Black background
+    cairo_paint(bg);
+
+    // Set up text properties
+    cairo_select_font_face(bg, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_source_rgb(bg, 1.0, 1.0, 1.0); // White text
 
     // Draw title
-    cairo_set_font_size(cr, 12);
+    cairo_set_font_size(bg, 12);
     const char *title = "INTERVAL TIMER";
     cairo_text_extents_t extents;
-    cairo_text_extents(cr, title, &extents);
-    cairo_move_to(cr, (screen_width - extents.width) / 2, 100);
-    cairo_show_text(cr, title);
+    cairo_text_extents(bg, title, &extents);
+    cairo_move_to(bg, (screen_width - extents.width) / 2, 100);
+    cairo_show_text(bg, title);
+
+    // Timer digits are centred on the screen, as the old single-string layout was
+    cairo_set_font_size(bg, TIMER_FONT_SIZE);
+    cairo_text_extents(bg, "0", &extents);
+    render_cache.timer_top = (int)((screen_height + extents.height) / 2) - glyph_cache.ascent;
+
+    // Progress bar geometry
+    render_cache.bar_width = screen_width * 0.8;
+    render_cache.bar_height = 16; // Thicker bars
+    render_cache.bar_x = (screen_width - render_cache.bar_width) / 2;
+    render_cache.overall_y = screen_height - 280;
+    render_cache.current_y = screen_height - 220;
+    render_cache.band_y = render_cache.overall_y - 8;
+    render_cache.band_height = render_cache.current_y + render_cache.bar_height - render_cache.band_y;
+    int margin = render_cache.bar_x;
+    int bar_width = render_cache.bar_width;
+    int bar_height = render_cache.bar_height;
+
+    // Bar backgrounds go on the static layer; a second copy of the band holds
+    // the filled bars, so progress is drawn by copying between the two
+    if (!render_cache.bars_filled) {
+        render_cache.bars_filled = cairo_surface_create_similar(surface, CAIRO_CONTENT_COLOR_ALPHA,
+                                                                screen_width, render_cache.band_height);
+    }
+    cairo_t *filled = cairo_create(render_cache.bars_filled);
+    cairo_set_source_rgb(filled, 0.0, 0.0, 0.0);
+    cairo_paint(filled);
+
+    // Draw overall progress bar background
+    cairo_set_source_rgb(bg, 0.2, 0.2, 0.2); // Dark gray background
+    cairo_rectangle(bg, margin, render_cache.overall_y, bar_width, bar_height);
+    cairo_fill(bg);
+
+    // Draw overall progress bar fill
+    cairo_set_source_rgb(filled, 0.0, 0.8, 0.0); // Green progress
+    cairo_rectangle(filled, margin, render_cache.overall_y - render_cache.band_y, bar_width, bar_height);
+    cairo_fill(filled);
+
+    // Draw overall progress ticks (bigger and more visible) on both layers
+    cairo_t *layers[2] = { bg, filled };
+    for (int l = 0; l < 2; l++) {
+        int offset = l == 0 ? 0 : render_cache.band_y;
+        cairo_set_source_rgb(layers[l], 0.8, 0.8, 0.8); // Bright white ticks
+        cairo_set_line_width(layers[l], 3.0); // Thicker tick lines
+        for (int i = 1; i < program_view.count; i++) {
+            int x = margin + (int)(bar_width * ((double)program_view.ticks_ns[i] / program_view.total_ns));
+            cairo_move_to(layers[l], x, render_cache.overall_y - 8 - offset);
+            cairo_line_to(layers[l], x, render_cache.overall_y + bar_height + 8 - offset);
+            cairo_stroke(layers[l]);
+        }
+    }
+
+    // Draw current interval progress bar background
+    cairo_set_source_rgb(bg, 0.2, 0.2, 0.2); // Dark gray background
+    cairo_rectangle(bg, margin, render_cache.current_y, bar_width, bar_height);
+    cairo_fill(bg);
+
+    // Draw current interval progress bar fill
+    cairo_set_source_rgb(filled, 0.0, 0.6, 1.0); // Blue progress
+    cairo_rectangle(filled, margin, render_cache.current_y - render_cache.band_y, bar_width, bar_height);
+    cairo_fill(filled);
+    cairo_destroy(filled);
+    cairo_destroy(bg);
+    render_cache.base_valid = 1;
+}
+
+void build_layout(int interval, int show_next, int banner) {
+    const char *label = program_view.label;
+    if (!glyph_cache.valid) {
+        setup_glyph_cache();
+    }
+    if (!render_cache.base_valid) {
+        build_base_layer();
+    }
+    if (!render_cache.background) {
+        render_cache.background = cairo_surface_create_similar(surface, CAIRO_CONTENT_COLOR_ALPHA,
+                                                               screen_width, screen_height);
+    }
+
+    // Start from the session-wide layer and add what depends on the interval
+    cairo_t *bg = cairo_create(render_cache.background);
+    cairo_set_operator(bg, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(bg, render_cache.base, 0, 0);
+    cairo_paint(bg);
+    cairo_set_operator(bg, CAIRO_OPERATOR_OVER);
+    cairo_select_font_face(bg, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_source_rgb(bg, 1.0, 1.0, 1.0); // White text
+    int margin = render_cache.bar_x;
+
+    // Draw interval label
+    cairo_text_extents_t extents;
+    cairo_set_font_size(bg, 64);
+    cairo_text_extents(bg, label, &extents);
+    cairo_move_to(bg, (screen_width - extents.width) / 2, 200);
+    cairo_show_text(bg, label);
+
+    // Draw progress labels (bigger text)
+    cairo_set_font_size(bg, 28); // Bigger font
+    cairo_set_source_rgb(bg, 1.0, 1.0, 1.0); // Bright white text
+
+    // Overall progress label
+    char overall_label[64];
+    snprintf(overall_label, sizeof(overall_label), "Training: %d/%d intervals", interval + 1, program_view.count);
+    cairo_move_to(bg, margin, render_cache.overall_y - 20);
+    cairo_show_text(bg, overall_label);
+
+    // Current interval label (positioned to avoid overlap)
+    char current_label[64];
+    snprintf(current_label, sizeof(current_label), "Current: %s", label);
+    cairo_move_to(bg, margin, render_cache.current_y - 20);
+    cairo_show_text(bg, current_label);
+
+    // Show next interval preview during last 30 seconds
+    if (show_next) {
+        char next_label[64];
+        snprintf(next_label, sizeof(next_label), "Next: %s", program_view.next_label);
+
+        // Use larger font and bright color for better visibility
+        cairo_set_font_size(bg, 32);
+        cairo_set_source_rgb(bg, 1.0, 1.0, 0.0); // Bright yellow for visibility
+        cairo_move_to(bg, margin, render_cache.current_y + 60);
+        cairo_show_text(bg, next_label);
+    }
+
+    if (banner != BANNER_NONE) {
+        cairo_set_font_size(bg, 48);
+        cairo_set_source_rgb(bg, 1.0, 1.0, 0.0); // Same yellow as the preview
+        char banner_text[64];
+        if (banner == BANNER_PAUSED) {
+            snprintf(banner_text, sizeof(banner_text), "PAUSED");
+        } else {
+            snprintf(banner_text, sizeof(banner_text), "STARTS AT %s", start_at_text);
+        }
+        cairo_text_extents(bg, banner_text, &extents);
+        cairo_move_to(bg, (screen_width - extents.width) / 2, 280);
+        cairo_show_text(bg, banner_text);
+    }
+
+    // Draw instructions
+    cairo_set_font_size(bg, 24);
+    cairo_set_source_rgb(bg, 1.0, 1.0, 1.0); // White text
+    const char *instructions[] = {
+        banner == BANNER_PAUSED ? "Press 'P' or SPACE to resume, 'S' to skip" :
+        banner == BANNER_WAITING ? "Training starts by itself at the time shown" :
+                                   "Press 'S' to skip, 'P' or SPACE to pause",
+        banner == BANNER_WAITING ? "Other keys do nothing until then" :
+                                   "Arrows seek, 'B' back, 1-9 jump, +/- change length, 'R' adds a rest",
+        "Press 'Q' or 'ESC' to quit",
+        "Intervals continue automatically"
+    };
+
+    for (int i = 0; i < 3; i++) {
+        cairo_text_extents(bg, instructions[i], &extents);
+        cairo_move_to(bg, (screen_width - extents.width) / 2, screen_height - 150 + i * 40);
+        cairo_show_text(bg, instructions[i]);
+    }
+    cairo_destroy(bg);
+
+    // Put the whole static layer on screen; dynamic parts start out empty
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, render_cache.background, 0, 0);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+    render_cache.drawn_time[0] = '\0';
+    render_cache.overall_fill = 0;
+    render_cache.current_fill = 0;
+    render_cache.interval = interval;
+    render_cache.show_next = show_next;
+    render_cache.banner = banner;
+    render_cache.valid = 1;
+}
+
+void draw_clock_text(const char *time_str) {
+    // Cell positions only depend on the string length, which is fixed per precision
+    int total_width = 0;
+    size_t len = strlen(time_str);
+    for (size_t i = 0; i < len; i++) {
+        total_width += glyph_width(time_str[i]);
+    }
+
+    int x = (screen_width - total_width) / 2;
+    int redraw_all = strlen(render_cache.drawn_time) != len;
+    if (redraw_all && render_cache.drawn_time[0]) {
+        // The text got longer or shorter ("100:00" to "99:59"), so the
+        // cells have moved; wipe everything the old text covered
+        int old_width = 0;
+        for (const char *c = render_cache.drawn_time; *c; c++) {
+            old_width += glyph_width(*c);
+        }
+        cairo_save(cr);
+        cairo_rectangle(cr, (screen_width - old_width) / 2, render_cache.timer_top, old_width, glyph_cache.height);
+        cairo_clip(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface(cr, render_cache.background, 0, 0);
+        cairo_paint(cr);
+        cairo_restore(cr);
+    }
+    for (size_t i = 0; i < len; i++) {
+        int g = glyph_index(time_str[i]);
+        if (g < 0) continue; // Nothing cached for it, so it takes no cell
+        if (redraw_all || render_cache.drawn_time[i] != time_str[i]) {
+            cairo_save(cr);
+            cairo_rectangle(cr, x, render_cache.timer_top, glyph_cache.width[g], glyph_cache.height);
+            cairo_clip(cr);
+            cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+            cairo_set_source_surface(cr, render_cache.background, 0, 0);
+            cairo_paint(cr);
+            cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+            cairo_set_source_surface(cr, glyph_cache.glyph[g], x, render_cache.timer_top);
+            cairo_paint(cr);
+            cairo_restore(cr);
+        }
+        x += glyph_cache.width[g];
+    }
+
+    strncpy(render_cache.drawn_time, time_str, sizeof(render_cache.drawn_time) - 1);
+    render_cache.drawn_time[sizeof(render_cache.drawn_time) - 1] = '\0';
+}
+
+int glyph_index(char c) {
+    // -1 for anything without a cached glyph, the terminator included
+    const char *found = c ? strchr(GLYPH_CHARS, c) : NULL;
+    return found ? (int)(found - GLYPH_CHARS) : -1;
+}
+
+int glyph_width(char c) {
+    int g = glyph_index(c);
+    return g < 0 ? 0 : glyph_cache.width[g];
+}
+
+void update_bar_fill(int y, int *drawn_fill, int fill) {
+    if (fill < 0) fill = 0;
+    if (fill > render_cache.bar_width) fill = render_cache.bar_width;
+    if (fill == *drawn_fill) return;
+
+    // Growing copies from the filled band, shrinking restores the background
+    int from = fill < *drawn_fill ? fill : *drawn_fill;
+    int to = fill < *drawn_fill ? *drawn_fill : fill;
+    int x = render_cache.bar_x + from;
+
+    // Include the tick overhang so ticks stay crisp on both layers
+    int top = y == render_cache.overall_y ? y - 8 : y;
+    int height = y == render_cache.overall_y ? render_cache.bar_height + 16 : render_cache.bar_height;
+
+    cairo_save(cr);
+    cairo_rectangle(cr, x, top, to - from, height);
+    cairo_clip(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    if (fill > *drawn_fill) {
+        cairo_set_source_surface(cr, render_cache.bars_filled, 0, render_cache.band_y);
+    } else {
+        cairo_set_source_surface(cr, render_cache.background, 0, 0);
+    }
+    cairo_paint(cr);
+    cairo_restore(cr);
+
+    *drawn_fill = fill;
+}
+
+void refresh_program_view(const FrameState *state) {
+    // Only an edit or a move to another interval changes what is shown
+    if (program_view.valid && program_view.version == state->program_version &&
+        program_view.interval == state->interval) {
+        return;
+    }
+
+    pthread_mutex_lock(&program_lock);
+    program_view.valid = 1;
+    program_view.version = state->program_version;
+    program_view.interval = state->interval;
+    program_view.count = interval_set.count;
+    program_view.total_ns = interval_set.total_ns;
+    program_view.id = program_id;
+    program_view.edits = program_edits;
+    int64_t tick_ns = 0;
+    for (int i = 0; i < interval_set.count; i++) {
+        program_view.ticks_ns[i] = tick_ns;
+        tick_ns += interval_set.intervals[i].duration_ms * NSEC_PER_MSEC;
+    }
+    int interval = state->interval < interval_set.count ? state->interval : interval_set.count - 1;
+    snprintf(program_view.label, sizeof(program_view.label), "%s", interval_set.intervals[interval].label);
+    program_view.next_label[0] = '\0';
+    if (interval + 1 < interval_set.count) {
+        snprintf(program_view.next_label, sizeof(program_view.next_label), "%s",
+                 interval_set.intervals[interval + 1].label);
+    }
+    pthread_mutex_unlock(&program_lock);
+}
+
+void invalidate_frame() {
+    render_cache.valid = 0;
+}
+
+void cleanup_render_cache() {
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        if (glyph_cache.glyph[i]) cairo_surface_destroy(glyph_cache.glyph[i]);
+        glyph_cache.glyph[i] = NULL;
+    }
+    glyph_cache.valid = 0;
+    if (render_cache.background) cairo_surface_destroy(render_cache.background);
+    if (render_cache.bars_filled) cairo_surface_destroy(render_cache.bars_filled);
+    if (render_cache.base) cairo_surface_destroy(render_cache.base);
+    render_cache.background = NULL;
+    render_cache.bars_filled = NULL;
+    render_cache.base = NULL;
+    render_cache.base_valid = 0;
+    render_cache.valid = 0;
+}
+
+void format_time(char *buf, size_t size, int64_t remaining_ns) {
+    // Round up so the full duration is shown first and zero never is
+    int64_t unit = display_unit_ns();
+    int64_t units = (remaining_ns + unit - 1) / unit;
+    int64_t units_per_second = NSEC_PER_SEC / unit;
+    int total_seconds = (int)(units / units_per_second);
+
+    if (display_precision > 0) {
+        snprintf(buf, size, "%02d:%02d.%0*d", total_seconds / 60, total_seconds % 60,
+                 display_precision, (int)(units % units_per_second));
+    } else {
+        snprintf(buf, size, "%02d:%02d", total_seconds / 60, total_seconds % 60);
+    }
+}
+
+int64_t display_unit_ns() {
+    int64_t unit = NSEC_PER_SEC;
+    for (int i = 0; i < display_precision; i++) {
+        unit /= 10;
+    }
+    return unit;
+}
+
+int64_t next_redraw_ns(const FrameState *state, int64_t now) {
+    int64_t interval_end = state->interval_end_ns;
+    int64_t interval_ns = state->interval_ns;
+
+    // Next change of the clock text
+    int64_t left = interval_end - now;
+    int64_t unit = display_unit_ns();
+    int64_t units_left = (left + unit - 1) / unit;
+    int64_t next = interval_end - (units_left - 1) * unit;
+
+    // Animated bars also change whenever either fill gains a pixel; before
+    // the start, the overall bar doesn't move
+    if (animate && render_cache.valid) {
+        int64_t width = render_cache.bar_width;
+        int64_t interval_start = interval_end - interval_ns;
+        int64_t total_ns = state->session_ns;
+
+        int64_t t = interval_start + ((render_cache.current_fill + 1) * interval_ns + width - 1) / width;
+        if (t < next) next = t;
+
+        t = interval_start - state->elapsed_before_ns + ((render_cache.overall_fill + 1) * total_ns + width - 1) / width;
+        if (t < next && state->phase != PHASE_WAITING) next = t;
+    }
+
+    // Never redraw faster than the monitor can show it
+    int64_t next_frame = now + (int64_t)(NSEC_PER_SEC / refresh_rate);
+    return next > next_frame ? next : next_frame;
+}
+
+void draw_completion_message(const char *label) {
+    if (!cr) return;
+    int64_t started = monotonic_ns();
+
+    // Draw completion message
+    cairo_set_source_rgb(cr, 0.0, 0.0, 0.0); // Black background
+    cairo_paint(cr);
+
+    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0); // White text
+
+    // Draw completion text
+    cairo_set_font_size(cr, 48);
+    const char *completion_text = "INTERVAL COMPLETE!";
+    cairo_text_extents_t extents;
+    cairo_text_extents(cr, completion_text, &extents);
+    cairo_move_to(cr, (screen_width - extents.width) / 2, screen_height / 2 - 100);
+    cairo_show_text(cr, completion_text);
+
+    // Draw interval name
+    cairo_set_font_size(cr, 36);
+    cairo_text_extents(cr, label, &extents);
+    cairo_move_to(cr, (screen_width - extents.width) / 2, screen_height / 2);
+    cairo_show_text(cr, label);
+
+    // Draw continue instruction
+    cairo_set_font_size(cr, 24);
+    const char *continue_text = "Continuing automatically in 2 seconds...";
+    cairo_text_extents(cr, continue_text, &extents);
+    cairo_move_to(cr, (screen_width - extents.width) / 2, screen_height / 2 + 100);
+    cairo_show_text(cr, continue_text);
+
+    flush_frame(started);
+}
+
+void flush_frame(int64_t started_ns) {
+    cairo_surface_flush(surface);
+    int64_t flush_start = monotonic_ns();
+    XFlush(render_display);
+    int64_t done = monotonic_ns();
+    stats.frames_drawn++;
+
+    ThreadMetrics *metrics = &thread_metrics[THREAD_RENDER];
+    metric_add(&metrics->frames_drawn, 1);
+    metric_observe(&metrics->x_flush, done - flush_start);
+    metric_observe(&metrics->frame_render, done - started_ns);
+}
+
+void begin_flash(FlashState *flash, int measure) {
+    invalidate_frame();
+
+    // White flash, timed to the server so later flashes can start early by
+    // however long a frame takes to get there
+    int64_t start = monotonic_ns();
+    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+    cairo_paint(cr);
+    cairo_surface_flush(surface);
+    XSync(render_display, False);
+    int64_t shown = monotonic_ns();
+    flash_lead_ns = (flash_lead_ns * 3 + (shown - start)) / 4;
+    stats.frames_drawn++;
+    metric_add(&thread_metrics[THREAD_RENDER].frames_drawn, 1);
+    metric_observe(&thread_metrics[THREAD_RENDER].frame_render, shown - start);
+    if (measure) {
+        record_av_offset(shown);
+    }
+
+    flash->start = start;
+    flash->step = 0;
+    flash->settled = 1;
+}
+
+int64_t draw_flash(FlashState *flash, int64_t now) {
+    // Alternate white and red every 200ms from the first flash. When
+    // animating, each change is blended over fade_ms and only redrawn
+    // while the blend is running.
+    static const double colours[2][3] = {
+        {1.0, 1.0, 1.0}, // White
+        {1.0, 0.0, 0.0}  // Red
+    };
+    int step = (int)((now - flash->start) / FLASH_STEP_NS);
+    int finished = step >= FLASH_STEPS;
+    if (finished) step = FLASH_STEPS - 1; // Hold the last colour
+    int64_t step_start = flash->start + step * FLASH_STEP_NS;
+
+    int64_t fade_ns = animate ? (int64_t)fade_ms * 1000000 : 0;
+    if (fade_ns > FLASH_STEP_NS) fade_ns = FLASH_STEP_NS;
+    double blend = (step == 0 || fade_ns == 0 || finished) ? 1.0 : (double)(now - step_start) / fade_ns;
+    if (blend > 1.0) blend = 1.0;
+
+    if (step != flash->step || !flash->settled) {
+        int64_t started = monotonic_ns();
+        const double *from = colours[(step + 1) % 2];
+        const double *to = colours[step % 2];
+        cairo_set_source_rgb(cr, from[0] + (to[0] - from[0]) * blend,
+                                 from[1] + (to[1] - from[1]) * blend,
+                                 from[2] + (to[2] - from[2]) * blend);
+        cairo_paint(cr);
+        flush_frame(started);
+        flash->step = step;
+        flash->settled = blend >= 1.0;
+    }
+
+    if (finished) return 0;
+    if (!flash->settled) return now + (int64_t)(NSEC_PER_SEC / refresh_rate);
+    return step_start + FLASH_STEP_NS;
+}
+
+void start_renderer() {
+    if (!cr) return;
+
+    renderer.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (renderer.wake_fd < 0) {
+        printf("Warning: Cannot create render wakeup: %s\n", strerror(errno));
+        return;
+    }
+    renderer.write_slot = 0;
+    renderer.middle = 1;
+    renderer.read_slot = 2;
+
+    // Drawing is never time-critical enough to preempt the timer
+    if (start_thread(&renderer.thread, render_thread_main, 0, "render") != 0) {
+        printf("Warning: Cannot start render thread\n");
+        close(renderer.wake_fd);
+        return;
+    }
+    renderer.started = 1;
+}
+
+void stop_renderer() {
+    if (!renderer.started) return;
+
+    FrameState state;
+    memset(&state, 0, sizeof(state));
+    state.phase = PHASE_DONE;
+    publish_state(&state);
+    pthread_join(renderer.thread, NULL);
+    close(renderer.wake_fd);
+    renderer.started = 0;
+}
+
+void publish_state(FrameState *state) {
+    export_status(state);
+    control_event(state);
+    sync_note_state(state);
+    if (!renderer.started) return;
+
+    // Fill the slot only we own, then swap it into the middle
+    state->sequence = ++renderer.sequence;
+    renderer.slots[renderer.write_slot] = *state;
+    int previous = __atomic_exchange_n(&renderer.middle, renderer.write_slot | SNAPSHOT_FRESH, __ATOMIC_ACQ_REL);
+    renderer.write_slot = previous & ~SNAPSHOT_FRESH;
+
+    uint64_t one = 1;
+    if (write(renderer.wake_fd, &one, sizeof(one)) < 0) {
+        // Already pending; the renderer will see the new slot anyway
+    }
+}
+
+const FrameState *consume_state() {
+    // Take the middle slot only if something newer was published into it
+    if (__atomic_load_n(&renderer.middle, __ATOMIC_ACQUIRE) & SNAPSHOT_FRESH) {
+        int previous = __atomic_exchange_n(&renderer.middle, renderer.read_slot, __ATOMIC_ACQ_REL);
+        renderer.read_slot = previous & ~SNAPSHOT_FRESH;
+    }
+    return &renderer.slots[renderer.read_slot];
+}
+
+void request_full_redraw() {
+    __atomic_store_n(&renderer.invalid, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (renderer.started && write(renderer.wake_fd, &one, sizeof(one)) < 0) {
+        // Already pending
+    }
+}
+
+void setup_status() {
+    int fd = shm_open(status_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Warning: Cannot create status segment %s: %s\n", status_name, strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, sizeof(IntervalStatus)) < 0) {
+        printf("Warning: Cannot size status segment: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, sizeof(IntervalStatus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Warning: Cannot map status segment: %s\n", strerror(errno));
+        return;
+    }
+
+    // Another timer still running owns the segment; leave it to that one
+    const IntervalStatus *existing = map;
+    pid_t owner = existing->magic == STATUS_MAGIC ? existing->pid : 0;
+    if (owner > 0 && owner != getpid() && existing->phase != STATUS_FINISHED &&
+        (kill(owner, 0) == 0 || errno == EPERM)) {
+        printf("Warning: Status segment %s belongs to timer %d, not publishing status (use --status-name)\n",
+               status_name, (int)owner);
+        munmap(map, sizeof(IntervalStatus));
+        return;
+    }
+
+    // Keep the sequence going from any earlier run, so a reader that
+    // mapped that one never sees it go backwards
+    status_export = map;
+    uint64_t sequence = __atomic_load_n(&status_export->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&status_export->sequence, (sequence | 1) + 1, __ATOMIC_RELEASE);
+    FrameState idle;
+    memset(&idle, 0, sizeof(idle));
+    idle.phase = -1;
+    export_status(&idle);
+}
+
+void cleanup_status() {
+    if (!status_export) return;
+
+    // Readers still mapping it see the session finished
+    FrameState done;
+    memset(&done, 0, sizeof(done));
+    done.phase = PHASE_DONE;
+    export_status(&done);
+    munmap(status_export, sizeof(IntervalStatus));
+    shm_unlink(status_name);
+    status_export = NULL;
+}
+
+void export_status(const FrameState *state) {
+    if (!status_export) return;
+
+    // Seqlock: readers retry if the sequence is odd or has moved, so this
+    // never waits for them, however many there are
+    IntervalStatus *out = status_export;
+    uint64_t sequence = __atomic_load_n(&out->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&out->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    out->magic = STATUS_MAGIC;
+    out->version = STATUS_VERSION;
+    out->pid = getpid();
+    out->interval_count = interval_set.count;
+    out->updated_ns = monotonic_ns();
+    if (state->phase < 0 || state->phase == PHASE_WAITING) {
+        out->phase = STATUS_IDLE;
+    } else if (state->phase == PHASE_DONE) {
+        out->phase = STATUS_FINISHED;
+    } else {
+        out->phase = state->phase == PHASE_RUNNING ? STATUS_RUNNING :
+                     state->phase == PHASE_PAUSED ? STATUS_PAUSED : STATUS_BOUNDARY;
+        out->interval = state->interval;
+        strncpy(out->label, interval_set.intervals[state->interval].label, STATUS_LABEL_LENGTH - 1);
+        out->label[STATUS_LABEL_LENGTH - 1] = '\0';
+        if (state->interval + 1 < interval_set.count) {
+            strncpy(out->next_label, interval_set.intervals[state->interval + 1].label, STATUS_LABEL_LENGTH - 1);
+            out->next_label[STATUS_LABEL_LENGTH - 1] = '\0';
+        } else {
+            out->next_label[0] = '\0';
+        }
+        out->interval_end_ns = state->interval_end_ns;
+        out->interval_ns = state->interval_ns;
+        out->paused_at_ns = state->paused_at_ns;
+        out->elapsed_before_ns = state->elapsed_before_ns;
+        out->session_ns = state->session_ns;
+    }
+
+    __atomic_store_n(&out->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void setup_control() {
+    if (!control_path) return;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(control_path) >= sizeof(addr.sun_path)) {
+        printf("Warning: Control socket path too long: %s\n", control_path);
+        return;
+    }
+    strcpy(addr.sun_path, control_path);
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        control.clients[i].fd = -1;
+    }
+    control.phase = -1;
+    control.pause_wanted = -1;
+    control.load_client = 0;
+    control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control.fd < 0) {
+        printf("Warning: Cannot create control socket: %s\n", strerror(errno));
+        return;
+    }
+
+    // A socket left behind by a crashed run would make bind fail
+    remove_stale_socket(control_path);
+    mode_t old_mask = umask(0077);
+    int bound = bind(control.fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(control.fd, CONTROL_MAX_CLIENTS) < 0) {
+        printf("Warning: Cannot listen on %s: %s\n", control_path, strerror(errno));
+        close(control.fd);
+        control.fd = -1;
+        return;
+    }
+    control.started = 1;
+}
+
+void remove_stale_socket(const char *path) {
+    // Only ever a socket; a path naming some other file by mistake is left
+    // alone and bind reports it
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+}
+
+void cleanup_control() {
+    if (!control.started) return;
+
+    // Last events go out if they can without waiting
+    flush_control();
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (control.clients[i].fd >= 0) drop_client(&control.clients[i]);
+    }
+    close(control.fd);
+    unlink(control_path);
+    control.started = 0;
+}
+
+int control_poll_fds(struct pollfd *pfds) {
+    // Listening socket first, then every client; output only when some is waiting
+    int n = 0;
+    pfds[n].fd = control.fd;
+    pfds[n].events = POLLIN;
+    pfds[n].revents = 0;
+    n++;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        ControlClient *client = &control.clients[i];
+        if (client->fd < 0) continue;
+        pfds[n].fd = client->fd;
+        pfds[n].events = POLLIN | (client->out_len > 0 ? POLLOUT : 0);
+        pfds[n].revents = 0;
+        n++;
+    }
+    return n;
+}
+
+void service_control(const struct pollfd *pfds, int count) {
+    if (pfds[0].revents & POLLIN) {
+        int fd;
+        while ((fd = accept4(control.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            ControlClient *client = NULL;
+            for (int i = 0; i < CONTROL_MAX_CLIENTS && !client; i++) {
+                if (control.clients[i].fd < 0) client = &control.clients[i];
+            }
+            if (!client) {
+                close(fd); // Full; the client sees the connection close
+                control.dropped++;
+                continue;
+            }
+            memset(client, 0, sizeof(*client));
+            client->fd = fd;
+            client->id = ++control.next_id;
+        }
+    }
+
+    for (int p = 1; p < count; p++) {
+        if (!pfds[p].revents) continue;
+        ControlClient *client = NULL;
+        for (int i = 0; i < CONTROL_MAX_CLIENTS && !client; i++) {
+            if (control.clients[i].fd == pfds[p].fd) client = &control.clients[i];
+        }
+        if (!client) continue;
+
+        if (pfds[p].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(client->fd, client->in + client->in_len, CONTROL_BUFFER_SIZE - client->in_len);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                drop_client(client);
+                continue;
+            }
+            if (n > 0) {
+                client->in_len += n;
+                handle_client_input(client);
+            }
+        }
+    }
+    flush_control();
+}
+
+void handle_client_input(ControlClient *client) {
+    // One command per line
+    char *start = client->in;
+    char *end;
+    while (client->fd >= 0 && (end = memchr(start, '\n', client->in + client->in_len - start))) {
+        *end = '\0';
+        if (end > start && end[-1] == '\r') end[-1] = '\0';
+        handle_control_command(client, start);
+        start = end + 1;
+    }
+    if (client->fd < 0) return;
+
+    int left = client->in + client->in_len - start;
+    if (left == CONTROL_BUFFER_SIZE) {
+        drop_client(client); // A line longer than the buffer
+        return;
+    }
+    memmove(client->in, start, left);
+    client->in_len = left;
+}
+
+void handle_control_command(ControlClient *client, char *line) {
+    char *word = strtok(line, " \t");
+    char *arg = strtok(NULL, "");
+    while (arg && (*arg == ' ' || *arg == '\t')) arg++;
+    if (!word) return;
+
+    // Nothing has started before a scheduled start, so only quitting and
+    // queries mean anything; the rest is refused rather than lost
+    if (control.phase == PHASE_WAITING && strcmp(word, "quit") != 0 &&
+        strcmp(word, "status") != 0 && strcmp(word, "subscribe") != 0) {
+        client_printf(client, "error waiting for the start\n");
+        return;
+    }
+
+    int64_t now = monotonic_ns();
+    if (strcmp(word, "skip") == 0) {
+        push_input(CMD_SKIP, 0, now);
+    } else if (strcmp(word, "pause") == 0 || strcmp(word, "resume") == 0) {
+        // The key toggles; here each word only ever goes one way. Judge by
+        // what was last asked for, so two in one read don't undo each other
+        int paused = control.pause_wanted >= 0 ? control.pause_wanted : control.phase == PHASE_PAUSED;
+        int want = word[0] == 'p';
+        if (paused != want) {
+            push_input(CMD_PAUSE, 0, now);
+            control.pause_wanted = want;
+        }
+    } else if (strcmp(word, "seek") == 0 && arg) {
+        // Relative, in seconds: "seek -10", "seek +30.5"
+        double seconds = atof(arg);
+        push_input(CMD_SCRUB, (int64_t)(seconds * NSEC_PER_SEC), now);
+    } else if (strcmp(word, "goto") == 0 && arg && atoi(arg) >= 1) {
+        push_input(CMD_JUMP, atoi(arg) - 1, now);
+    } else if (strcmp(word, "back") == 0) {
+        push_input(CMD_PREVIOUS, 0, now);
+    } else if (strcmp(word, "start") == 0) {
+        // Restart this program, or switch to another one
+        if (!arg || !*arg) {
+            push_input(CMD_JUMP, 0, now);
+        } else if (access(arg, R_OK) != 0 || strlen(arg) >= sizeof(control_program)) {
+            client_printf(client, "error cannot read %s\n", arg);
+            return;
+        } else if (control.load_client) {
+            client_printf(client, "error already loading %s\n", control_program);
+            return;
+        } else {
+            // Answered once the timer thread has tried it
+            strcpy(control_program, arg);
+            push_input(CMD_LOAD, 0, now);
+            control.load_client = client->id;
+            return;
+        }
+    } else if (strcmp(word, "quit") == 0) {
+        push_input(CMD_QUIT, 0, now);
+    } else if (strcmp(word, "subscribe") == 0) {
+        client->subscribed = 1;
+    } else if (strcmp(word, "status") == 0) {
+        int64_t remaining = control.phase == PHASE_PAUSED ? control.interval_end_ns - control.paused_at_ns :
+                            control.interval_end_ns - now;
+        if (remaining < 0) remaining = 0;
+        client_printf(client, "status %s %d %d %lld %s\n", control_phase_name(control.phase),
+                      control.interval + 1, interval_set.count, (long long)(remaining / NSEC_PER_MSEC),
+                      interval_set.intervals[control.interval].label);
+        return;
+    } else {
+        client_printf(client, "error unknown command\n");
+        return;
+    }
+    client_printf(client, "ok\n");
+}
+
+void control_load_done(int loaded) {
+    if (!control.started || !control.load_client) return;
+
+    // The client may have gone, and its slot and fd been taken, in the meantime
+    ControlClient *client = NULL;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS && !client; i++) {
+        if (control.clients[i].fd >= 0 && control.clients[i].id == control.load_client) client = &control.clients[i];
+    }
+    control.load_client = 0;
+    if (!client) return;
+    if (loaded) {
+        client_printf(client, "ok\n");
+    } else {
+        client_printf(client, "error no intervals in %s\n", control_program);
+    }
+}
+
+const char *control_phase_name(int phase) {
+    switch (phase) {
+        case PHASE_RUNNING: return "running";
+        case PHASE_PAUSED: return "paused";
+        case PHASE_FLASH: return "boundary";
+        case PHASE_COMPLETE: return "complete";
+        case PHASE_DONE: return "finished";
+        case PHASE_WAITING: return "waiting";
+    }
+    return "starting";
+}
+
+void control_event(const FrameState *state) {
+    if (!control.started) return;
+
+    // Only changes a console cares about; repeated running states after a
+    // seek or an edit within the same interval don't count
+    char event[128];
+    event[0] = '\0';
+    if (state->phase == PHASE_RUNNING && control.phase == PHASE_PAUSED) {
+        snprintf(event, sizeof(event), "resume\n");
+    } else if (state->phase == PHASE_RUNNING &&
+               (state->interval != control.interval || state->program_version != control.program_version ||
+                control.phase != PHASE_RUNNING)) {
+        snprintf(event, sizeof(event), "interval %d %d %d %s\n", state->interval + 1, interval_set.count,
+                 interval_set.intervals[state->interval].duration_ms, interval_set.intervals[state->interval].label);
+    } else if (state->phase == PHASE_PAUSED && control.phase != PHASE_PAUSED) {
+        snprintf(event, sizeof(event), "pause\n");
+    } else if (state->phase == PHASE_COMPLETE && control.phase != PHASE_COMPLETE) {
+        snprintf(event, sizeof(event), "complete %d\n", state->interval + 1);
+    } else if (state->phase == PHASE_DONE) {
+        snprintf(event, sizeof(event), "finished\n");
+    }
+
+    if ((state->phase == PHASE_PAUSED) != (control.phase == PHASE_PAUSED)) {
+        control.pause_wanted = -1; // Whatever was asked for has happened
+    }
+    control.phase = state->phase;
+    if (state->phase != PHASE_DONE) {
+        control.interval = state->interval;
+        control.program_version = state->program_version;
+        control.interval_end_ns = state->interval_end_ns;
+        control.paused_at_ns = state->paused_at_ns;
+    }
+    if (!event[0]) return;
+
+    // Queued only; everything queued this time round the loop goes out in
+    // one write per client before the next wait
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        ControlClient *client = &control.clients[i];
+        if (client->fd >= 0 && client->subscribed) {
+            client_printf(client, "%s", event);
+        }
+    }
+}
+
+void client_printf(ControlClient *client, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(client->out + client->out_len, CONTROL_BUFFER_SIZE - client->out_len, format, args);
+    va_end(args);
+
+    // A client that far behind isn't reading; it goes rather than the clock waiting
+    if (n < 0 || client->out_len + n >= CONTROL_BUFFER_SIZE) {
+        control.dropped++;
+        drop_client(client);
+        return;
+    }
+    client->out_len += n;
+}
+
+void flush_control() {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        ControlClient *client = &control.clients[i];
+        if (client->fd < 0 || client->out_len == 0) continue;
+
+        ssize_t n = send(client->fd, client->out, client->out_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) drop_client(client);
+            continue;
+        }
+        memmove(client->out, client->out + n, client->out_len - n);
+        client->out_len -= n;
+    }
+}
+
+void drop_client(ControlClient *client) {
+    close(client->fd);
+    client->fd = -1;
+    client->in_len = 0;
+    client->out_len = 0;
+    client->subscribed = 0;
+}
+
+void metric_add(uint64_t *counter, uint64_t n) {
+    // Only the owning thread writes, so a plain add is enough; the atomic
+    // store just keeps a concurrent scrape from seeing a torn value
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void metric_observe(MetricHistogram *histogram, int64_t value_ns) {
+    int bucket = 0;
+    while (bucket < METRIC_BUCKETS - 1 && value_ns > (METRIC_BASE_NS << bucket)) {
+        bucket++;
+    }
+    metric_add(&histogram->buckets[bucket], 1);
+    metric_add(&histogram->sum_ns, value_ns > 0 ? value_ns : 0);
+    metric_add(&histogram->count, 1);
+}
+
+void setup_metrics() {
+    if (!metrics_address) return;
+
+    // A bare number is a port on the loopback interface, anything else a socket path
+    struct sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+    socklen_t addr_len;
+    char *end;
+    long port = strtol(metrics_address, &end, 10);
+    if (*end == '\0' && port > 0 && port < 65536) {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&storage;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons((uint16_t)port);
+        addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr_len = sizeof(*addr);
+    } else {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&storage;
+        addr->sun_family = AF_UNIX;
+        if (strlen(metrics_address) >= sizeof(addr->sun_path)) {
+            printf("Warning: Metrics socket path too long: %s\n", metrics_address);
+            return;
+        }
+        strcpy(addr->sun_path, metrics_address);
+        addr_len = sizeof(*addr);
+        metrics_server.is_unix = 1;
+        remove_stale_socket(metrics_address);
+    }
+
+    for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+        metrics_server.connections[i].fd = -1;
+    }
+    metrics_server.fd = socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (metrics_server.fd < 0) {
+        printf("Warning: Cannot create metrics socket: %s\n", strerror(errno));
+        return;
+    }
+    int one = 1;
+    setsockopt(metrics_server.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(metrics_server.fd, (struct sockaddr *)&storage, addr_len) < 0 ||
+        listen(metrics_server.fd, METRICS_MAX_CONNECTIONS) < 0) {
+        printf("Warning: Cannot serve metrics on %s: %s\n", metrics_address, strerror(errno));
+        close(metrics_server.fd);
+        metrics_server.fd = -1;
+        return;
+    }
+    metrics_server.started = 1;
+}
+
+void cleanup_metrics() {
+    if (!metrics_server.started) return;
+
+    for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+        if (metrics_server.connections[i].fd >= 0) close_metrics_connection(&metrics_server.connections[i]);
+    }
+    close(metrics_server.fd);
+    if (metrics_server.is_unix) unlink(metrics_address);
+    metrics_server.started = 0;
+}
+
+int metrics_poll_fds(struct pollfd *pfds) {
+    // Reading the request until there is a reply, then writing it out
+    int n = 0;
+    pfds[n].fd = metrics_server.fd;
+    pfds[n].events = POLLIN;
+    pfds[n].revents = 0;
+    n++;
+    for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+        MetricsConnection *connection = &metrics_server.connections[i];
+        if (connection->fd < 0) continue;
+        pfds[n].fd = connection->fd;
+        pfds[n].events = connection->response ? POLLOUT : POLLIN;
+        pfds[n].revents = 0;
+        n++;
+    }
+    return n;
+}
+
+void service_metrics(const struct pollfd *pfds, int count) {
+    int64_t now = monotonic_ns();
+    if (pfds[0].revents & POLLIN) {
+        int fd;
+        while ((fd = accept4(metrics_server.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            MetricsConnection *connection = NULL;
+            for (int i = 0; i < METRICS_MAX_CONNECTIONS && !connection; i++) {
+                if (metrics_server.connections[i].fd < 0) connection = &metrics_server.connections[i];
+            }
+            if (!connection) {
+                close(fd);
+                continue;
+            }
+            connection->fd = fd;
+            connection->len = 0;
+            connection->request[0] = '\0';
+            connection->response_len = 0;
+            connection->sent = 0;
+            connection->deadline_ns = now + METRICS_TIMEOUT_NS;
+        }
+    }
+
+    // Answer once the request header is in; what it asks for doesn't matter
+    for (int p = 1; p < count; p++) {
+        if (!pfds[p].revents) continue;
+        for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+            MetricsConnection *connection = &metrics_server.connections[i];
+            if (connection->fd != pfds[p].fd) continue;
+
+            if (connection->response) {
+                if (send_metrics(connection) != 0) close_metrics_connection(connection);
+                break;
+            }
+            ssize_t n = read(connection->fd, connection->request + connection->len,
+                             sizeof(connection->request) - 1 - connection->len);
+            if (n > 0) {
+                connection->len += n;
+                connection->request[connection->len] = '\0';
+            }
+            int complete = strstr(connection->request, "\r\n\r\n") || strstr(connection->request, "\n\n");
+            if (complete || connection->len == sizeof(connection->request) - 1) {
+                write_metrics(connection);
+                if (send_metrics(connection) != 0) close_metrics_connection(connection);
+            } else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                close_metrics_connection(connection);
+            }
+            break;
+        }
+    }
+
+    // A scraper that never sends its request, or never reads the reply,
+    // doesn't get to keep a slot
+    for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+        MetricsConnection *connection = &metrics_server.connections[i];
+        if (connection->fd >= 0 && now >= connection->deadline_ns) {
+            close_metrics_connection(connection);
+        }
+    }
+}
+
+int64_t metrics_deadline_ns() {
+    int64_t deadline = INT64_MAX;
+    for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+        const MetricsConnection *connection = &metrics_server.connections[i];
+        if (connection->fd >= 0 && connection->deadline_ns < deadline) deadline = connection->deadline_ns;
+    }
+    return deadline;
+}
+
+void close_metrics_connection(MetricsConnection *connection) {
+    close(connection->fd);
+    connection->fd = -1;
+    free(connection->response);
+    connection->response = NULL;
+}
+
+int send_metrics(MetricsConnection *connection) {
+    // 1 once it has all gone, -1 on error, 0 while the socket is full
+    while (connection->sent < connection->response_len) {
+        ssize_t n = send(connection->fd, connection->response + connection->sent,
+                         connection->response_len - connection->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        connection->sent += n;
+    }
+    return 1;
+}
+
+void print_histogram(FILE *out, const char *name, const char *help, size_t field) {
+    // Sum the per-thread copies; each thread only ever fills its own
+    uint64_t buckets[METRIC_BUCKETS] = { 0 };
+    uint64_t sum_ns = 0, count = 0;
+    for (int t = 0; t < METRIC_THREADS; t++) {
+        const MetricHistogram *histogram = (const MetricHistogram *)((const char *)&thread_metrics[t] + field);
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            buckets[b] += __atomic_load_n(&histogram->buckets[b], __ATOMIC_RELAXED);
+        }
+        sum_ns += __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+        count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    }
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    for (int b = 0; b < METRIC_BUCKETS - 1; b++) {
+        cumulative += buckets[b];
+        fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(METRIC_BASE_NS << b) / NSEC_PER_SEC,
+                (unsigned long long)cumulative);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+    fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, (double)sum_ns / NSEC_PER_SEC, name,
+            (unsigned long long)count);
+}
+
+void print_counter(FILE *out, const char *name, const char *help, size_t field) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    uint64_t total = 0;
+    for (int t = 0; t < METRIC_THREADS; t++) {
+        total += __atomic_load_n((const uint64_t *)((const char *)&thread_metrics[t] + field), __ATOMIC_RELAXED);
+    }
+    fprintf(out, "%s %llu\n", name, (unsigned long long)total);
+}
+
+void write_metrics(MetricsConnection *connection) {
+    static const char *thread_names[METRIC_THREADS] = { "timer", "render", "audio", "music" };
+    char *body = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&body, &size);
+    if (!out) return;
+
+    print_counter(out, "interval_timer_frames_drawn_total", "Frames flushed to the X server.",
+                  offsetof(ThreadMetrics, frames_drawn));
+    print_counter(out, "interval_timer_audio_underruns_total", "Audio periods the device ran out of.",
+                  offsetof(ThreadMetrics, audio_underruns));
+    print_counter(out, "interval_timer_pcm_recoveries_total", "Calls to snd_pcm_recover after a write error.",
+                  offsetof(ThreadMetrics, pcm_recoveries));
+    print_counter(out, "interval_timer_music_dropouts_total", "Audio periods with no music ready.",
+                  offsetof(ThreadMetrics, music_dropouts));
+    print_counter(out, "interval_timer_intervals_completed_total", "Intervals run out or skipped.",
+                  offsetof(ThreadMetrics, intervals_completed));
+    print_counter(out, "interval_timer_sessions_completed_total", "Sessions run to the end.",
+                  offsetof(ThreadMetrics, sessions_completed));
+
+    fprintf(out, "# HELP interval_timer_wakeups_total Returns from blocking waits.\n"
+                 "# TYPE interval_timer_wakeups_total counter\n");
+    for (int t = 0; t < METRIC_THREADS; t++) {
+        fprintf(out, "interval_timer_wakeups_total{thread=\"%s\"} %llu\n", thread_names[t],
+                (unsigned long long)__atomic_load_n(&thread_metrics[t].wakeups, __ATOMIC_RELAXED));
+    }
+
+    print_histogram(out, "interval_timer_frame_render_seconds", "Time to draw and flush one frame.",
+                    offsetof(ThreadMetrics, frame_render));
+    print_histogram(out, "interval_timer_x_flush_seconds", "Time spent in XFlush per frame.",
+                    offsetof(ThreadMetrics, x_flush));
+    print_histogram(out, "interval_timer_tick_lateness_seconds", "How late timed waits returned.",
+                    offsetof(ThreadMetrics, tick_lateness));
+    fclose(out);
+
+    // Header and body in one buffer; whatever the socket won't take now
+    // goes out as it drains
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n", size);
+    connection->response = malloc(header_len + size);
+    if (connection->response) {
+        memcpy(connection->response, header, header_len);
+        memcpy(connection->response + header_len, body, size);
+        connection->response_len = header_len + size;
+        connection->sent = 0;
+    }
+    free(body);
+}
+
+void setup_sync() {
+    if (!sync_address) return;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (clock_sync.leader) {
+        // Any interface, so screens in other rooms can reach it
+        long port = strtol(sync_address, NULL, 10);
+        if (port <= 0 || port >= 65536) {
+            printf("Warning: Invalid sync port: %s\n", sync_address);
+            return;
+        }
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else {
+        char host[256];
+        const char *colon = strrchr(sync_address, ':');
+        if (!colon || colon == sync_address || (size_t)(colon - sync_address) >= sizeof(host)) {
+            printf("Warning: Sync leader must be HOST:PORT, not %s\n", sync_address);
+            return;
+        }
+        memcpy(host, sync_address, colon - sync_address);
+        host[colon - sync_address] = '\0';
+
+        struct addrinfo hints, *found;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        int err = getaddrinfo(host, colon + 1, &hints, &found);
+        if (err != 0) {
+            printf("Warning: Cannot find sync leader %s: %s\n", sync_address, gai_strerror(err));
+            return;
+        }
+        memcpy(&addr, found->ai_addr, sizeof(addr));
+        freeaddrinfo(found);
+    }
+
+    clock_sync.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (clock_sync.fd < 0) {
+        printf("Warning: Cannot create sync socket: %s\n", strerror(errno));
+        return;
+    }
+    // Followers only ever hear from their leader
+    int ok = clock_sync.leader ? bind(clock_sync.fd, (struct sockaddr *)&addr, sizeof(addr))
+                               : connect(clock_sync.fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ok < 0) {
+        printf("Warning: Cannot use sync address %s: %s\n", sync_address, strerror(errno));
+        close(clock_sync.fd);
+        clock_sync.fd = -1;
+        return;
+    }
+    clock_sync.phase = -1;
+    clock_sync.next_poll_ns = clock_sync.leader ? INT64_MAX : monotonic_ns();
+    clock_sync.started = 1;
+}
+
+void cleanup_sync() {
+    if (!clock_sync.started) return;
+    close(clock_sync.fd);
+    clock_sync.started = 0;
+}
+
+void sync_note_state(const FrameState *state) {
+    if (!clock_sync.started) return;
+    clock_sync.phase = state->phase;
+    clock_sync.elapsed_before_ns = state->elapsed_before_ns;
+    clock_sync.interval_ns = state->interval_ns;
+    clock_sync.interval_end_ns = state->interval_end_ns;
+    clock_sync.paused_at_ns = state->paused_at_ns;
+}
+
+int64_t sync_position(int64_t now) {
+    // Where this instance is in the program, frozen while paused
+    if (clock_sync.phase == PHASE_PAUSED) now = clock_sync.paused_at_ns;
+    return clock_sync.elapsed_before_ns + clock_sync.interval_ns - (clock_sync.interval_end_ns - now);
+}
+
+void service_sync(const struct pollfd *pfd) {
+    SyncPacket packet;
+    if (pfd->revents & (POLLIN | POLLERR)) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n;
+        while (1) {
+            n = recvfrom(clock_sync.fd, &packet, sizeof(packet), 0, (struct sockaddr *)&from, &from_len);
+            if (n < 0) {
+                // A leader that isn't up answers with port unreachable. Taking
+                // the error here clears it, or poll would report it forever;
+                // the next poll simply tries again
+                if (errno == ECONNREFUSED || errno == EINTR) continue;
+                break;
+            }
+            int64_t received = monotonic_ns();
+            if (n != sizeof(packet) || packet.magic != SYNC_MAGIC) continue;
+            if (clock_sync.leader) {
+                // Stamp it as late as possible, so our turnaround drops out
+                packet.t2 = received;
+                packet.program = program_id;
+                packet.phase = clock_sync.phase;
+                packet.t3 = monotonic_ns();
+                packet.elapsed_ns = sync_position(packet.t3);
+                sendto(clock_sync.fd, &packet, sizeof(packet), 0, (struct sockaddr *)&from, from_len);
+            } else if (packet.sequence == clock_sync.sequence) {
+                sync_sample(&packet, received);
+            }
+            from_len = sizeof(from);
+        }
+    }
+
+    if (!clock_sync.leader && monotonic_ns() >= clock_sync.next_poll_ns) {
+        // Polled quickly until the filter has a full window, then gently
+        memset(&packet, 0, sizeof(packet));
+        packet.magic = SYNC_MAGIC;
+        packet.sequence = ++clock_sync.sequence;
+        packet.t1 = monotonic_ns();
+        if (send(clock_sync.fd, &packet, sizeof(packet), 0) < 0) {
+            // Leader not up yet; the next poll tries again
+        }
+        clock_sync.next_poll_ns = packet.t1 + (clock_sync.samples < SYNC_SAMPLES ? SYNC_FAST_POLL_NS : SYNC_POLL_NS);
+    }
+}
+
+void sync_sample(const SyncPacket *packet, int64_t t4) {
+    if (packet->program != program_id && !clock_sync.warned) {
+        printf("Warning: Sync leader is running a different program\n");
+        clock_sync.warned = 1;
+    }
+
+    // NTP's estimate: the leader's clock minus ours, assuming the request
+    // and the reply took as long as each other. Queueing only ever adds
+    // delay, so the round trip with the least of it is the one to trust.
+    SyncSample *sample = &clock_sync.window[clock_sync.samples++ % SYNC_SAMPLES];
+    sample->offset_ns = ((packet->t2 - packet->t1) + (packet->t3 - t4)) / 2;
+    sample->delay_ns = (t4 - packet->t1) - (packet->t3 - packet->t2);
+    int filled = clock_sync.samples < SYNC_SAMPLES ? clock_sync.samples : SYNC_SAMPLES;
+    const SyncSample *best = sample;
+    for (int i = 0; i < filled; i++) {
+        if (clock_sync.window[i].delay_ns < best->delay_ns) best = &clock_sync.window[i];
+    }
+    clock_sync.offset_ns = best->offset_ns;
+    clock_sync.delay_ns = best->delay_ns;
+    stats.sync_rounds++;
+
+    // Follow the leader's pauses, then ask again soon to line up after
+    // them; only positions while both run compare
+    int64_t now = monotonic_ns();
+    if ((packet->phase == PHASE_PAUSED && clock_sync.phase == PHASE_RUNNING) ||
+        (packet->phase == PHASE_RUNNING && clock_sync.phase == PHASE_PAUSED)) {
+        push_input(CMD_PAUSE, 0, now);
+        clock_sync.next_poll_ns = now + SYNC_FAST_POLL_NS;
+        return;
+    }
+    if (packet->phase != PHASE_RUNNING || clock_sync.phase != PHASE_RUNNING) return;
+
+    // Positive when we're ahead of the leader
+    int64_t leader_ns = packet->elapsed_ns + (now + clock_sync.offset_ns - packet->t3);
+    int64_t error_ns = sync_position(now) - leader_ns;
+    clock_sync.error_ns = error_ns;
+    if (llabs(error_ns) / 1000.0 > stats.sync_error_max_us && clock_sync.samples > SYNC_SAMPLES) {
+        stats.sync_error_max_us = llabs(error_ns) / 1000.0;
+    }
+
+    // Far off means a seek or a late start: jump there. Otherwise move
+    // the boundary a little at a time, leaving the last seconds alone
+    // so cues already counting down aren't cut and scheduled again.
+    if (llabs(error_ns) > SYNC_STEP_NS) {
+        push_input(CMD_SYNC_STEP, error_ns, now);
+        stats.sync_steps++;
+    } else if (llabs(error_ns) > SYNC_DEADBAND_NS &&
+               clock_sync.interval_end_ns - now > (countdown_pips + 2) * NSEC_PER_SEC) {
+        int64_t slew_ns = error_ns;
+        if (slew_ns > SYNC_SLEW_NS) slew_ns = SYNC_SLEW_NS;
+        if (slew_ns < -SYNC_SLEW_NS) slew_ns = -SYNC_SLEW_NS;
+        push_input(CMD_SYNC, slew_ns, now);
+        stats.sync_slews++;
+    }
+}
+
+void *render_thread_main(void *arg) {
+    (void)arg;
+    uint64_t seen = 0;
+    FlashState flash;
+    memset(&flash, 0, sizeof(flash));
+    int message_drawn = 0;
+    int64_t pending_input_ns = 0;  // Key press whose effect hasn't been drawn yet
+
+    while (1) {
+        const FrameState *state = consume_state();
+        if (state->phase == PHASE_DONE) break;
+        if (state->sequence != seen) {
+            seen = state->sequence;
+            flash.start = 0;
+            message_drawn = 0;
+            pending_input_ns = state->input_ns;
+        }
+        if (__atomic_exchange_n(&renderer.invalid, 0, __ATOMIC_ACQ_REL)) {
+            invalidate_frame();
+            flash.step = -1;
+            message_drawn = 0;
+        }
+
+        // Count down until the flash is due, then flash; a completed
+        // interval flashes straight away and then shows its message
+        int64_t now = monotonic_ns();
+        int64_t next = INT64_MAX;
+        long frames_before = stats.frames_drawn;
+        int64_t flash_at = state->phase == PHASE_COMPLETE ? 0 : state->flash_ns - flash_lead_ns;
+        if (state->sequence != 0) {
+            refresh_program_view(state);
+        }
+        if (state->sequence == 0) {
+            // Nothing published yet
+        } else if (state->phase == PHASE_PAUSED) {
+            // One frame with the clock stopped, then sleep until resumed
+            draw_timer(state, state->paused_at_ns);
+        } else if (flash.start == 0 && now < flash_at) {
+            if (state->phase == PHASE_RUNNING || state->phase == PHASE_WAITING) {
+                draw_timer(state, now);
+                next = next_redraw_ns(state, now);
+            }
+            if (next > flash_at) next = flash_at;
+        } else {
+            if (flash.start == 0) {
+                begin_flash(&flash, state->phase != PHASE_COMPLETE);
+                now = monotonic_ns();
+            }
+            next = draw_flash(&flash, now);
+            if (next == 0) {
+                next = INT64_MAX;
+                if (state->phase == PHASE_COMPLETE && !message_drawn) {
+                    draw_completion_message(program_view.label);
+                    message_drawn = 1;
+                }
+            }
+        }
+        if (state->sequence != 0) {
+            checkpoint_state(state, now);
+        }
+
+        // Every draw ends in a flush, so the first frame after a key press
+        // is the one that reflects it. A skip holds its flash back to line
+        // up with the beep; that wait is deliberate and isn't counted
+        if (pending_input_ns > 0 && stats.frames_drawn != frames_before) {
+            int64_t from = pending_input_ns;
+            if (flash.start != 0 && flash_at > from) from = flash_at;
+            record_latency(&stats.input_to_flush, monotonic_ns() - from);
+            pending_input_ns = 0;
+        }
+        render_wait(next);
+    }
+    return NULL;
+}
+
+void render_wait(int64_t deadline_ns) {
+    struct pollfd pfd;
+    pfd.fd = renderer.wake_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    // A new state or a repaint request cuts the wait short
+    struct timespec timeout;
+    struct timespec *timeout_ptr = NULL;
+    if (deadline_ns != INT64_MAX) {
+        int64_t timeout_ns = deadline_ns - monotonic_ns();
+        if (timeout_ns < 0) timeout_ns = 0;
+        timeout.tv_sec = timeout_ns / NSEC_PER_SEC;
+        timeout.tv_nsec = timeout_ns % NSEC_PER_SEC;
+        timeout_ptr = &timeout;
+    }
+    if (ppoll(&pfd, 1, timeout_ptr, NULL) > 0) {
+        uint64_t count;
+        if (read(renderer.wake_fd, &count, sizeof(count)) < 0) {
+            // Nothing to drain
+        }
+    }
+    stats.render_wakeups++;
+    metric_add(&thread_metrics[THREAD_RENDER].wakeups, 1);
+}
+
+int wait_for_command(int64_t deadline_ns, InputEvent *event) {
+    // Anything already queued comes first, in order; otherwise wait for
+    // input or the deadline, whichever is sooner
+    while (running) {
+        if (next_input(event)) return event->command;
+        if (monotonic_ns() >= deadline_ns) break;
+        wait_for_events(deadline_ns);
+        poll_x11_input();
+    }
+    return CMD_NONE;
+}
+
+int pause_interval(FrameState *state, InputEvent *input, int continued) {
+    // Freeze the timeline where the key was pressed. Nothing is scheduled
+    // while paused, so neither this thread nor the audio wakes until input.
+    // A pause carried over a seek is still the same pause.
+    int64_t paused_at = input->time_ns;
+    reset_audio();
+    audio_set_paused(1);
+    state->phase = PHASE_PAUSED;
+    state->paused_at_ns = paused_at;
+    if (!continued) state->input_ns = input->time_ns;
+    publish_state(state);
+
+    // Edits change the stopped interval and leave it stopped
+    int command;
+    do {
+        command = wait_for_command(INT64_MAX, input);
+        if (command == CMD_ADJUST || command == CMD_INSERT_REST) {
+            edit_program(state, input);
+        }
+    } while ((command == CMD_NONE || command == CMD_SYNC || command == CMD_SYNC_STEP ||
+              command == CMD_ADJUST || command == CMD_INSERT_REST) && running);
+
+    // Shift by the span between the two key presses, as stamped by the
+    // server, so scheduling delays on either side don't leak into it
+    int64_t paused_ns = (command == CMD_NONE ? monotonic_ns() : input->time_ns) - paused_at;
+    if (paused_ns < 0) paused_ns = 0;
+    if (!continued) stats.pauses++;
+    stats.paused_ns += paused_ns;
+    audio_set_paused(0);
+
+    state->phase = PHASE_RUNNING;
+    state->interval_end_ns += paused_ns;
+    state->flash_ns = state->interval_end_ns;
+    state->input_ns = input->time_ns;
+    if (command == CMD_PAUSE) {
+        publish_state(state);
+    }
+    state->input_ns = 0;
+    return command;
+}
+
+int64_t seek_target(const InputEvent *input, int64_t elapsed_ns) {
+    int64_t target = elapsed_ns;
+    int interval = find_interval(elapsed_ns);
+    if (input->command == CMD_SCRUB) {
+        target = elapsed_ns + input->arg;
+    } else if (input->command == CMD_SYNC_STEP) {
+        target = elapsed_ns - input->arg; // Back by however far ahead of the leader
+    } else if (input->command == CMD_PREVIOUS) {
+        // Like a music player: back to the start, or further if already there
+        target = interval_start_ns(interval);
+        if (elapsed_ns - target < REWIND_GRACE_NS && interval > 0) {
+            target = interval_start_ns(interval - 1);
+        }
+    } else if (input->command == CMD_JUMP && input->arg < interval_set.count) {
+        target = interval_start_ns(input->arg);
+    }
+
+    // Stay inside the session; the very end still leaves a boundary to play
+    if (target < 0) target = 0;
+    if (target >= interval_set.total_ns) target = interval_set.total_ns - 1;
+    return target;
+}
+
+void edit_program(FrameState *state, const InputEvent *input) {
+    // Only this thread writes the program, so it reads it freely; the
+    // lock keeps the renderer from seeing an edit half done
+    Interval *interval = &interval_set.intervals[current_interval];
+    pthread_mutex_lock(&program_lock);
+    if (input->command == CMD_ADJUST) {
+        // Never shorter than what has already run, nor than a second; while
+        // paused, that is up to where the clock stopped
+        int64_t at_ns = state->phase == PHASE_PAUSED ? state->paused_at_ns : input->time_ns;
+        int64_t done_ns = state->interval_ns - (state->interval_end_ns - at_ns);
+        int shortest = (int)((done_ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+        if (shortest < 1000) shortest = 1000;
+        int duration_ms = interval->duration_ms + (int)input->arg;
+        if (duration_ms < shortest) duration_ms = shortest;
+
+        int64_t delta_ns = (duration_ms - interval->duration_ms) * NSEC_PER_MSEC;
+        interval->duration_ms = duration_ms;
+        index_add(current_interval, delta_ns);
+        state->interval_ns += delta_ns;
+        state->interval_end_ns += delta_ns;
+        state->flash_ns = state->interval_end_ns;
+        record_edit(CMD_ADJUST, current_interval, duration_ms);
+    } else if (insert_interval(current_interval + 1, "Rest", INSERT_REST_MS) == 0) {
+        record_edit(CMD_INSERT_REST, current_interval + 1, INSERT_REST_MS);
+    }
+    interval_set.version++;
+    pthread_mutex_unlock(&program_lock);
+
+    // Boundary cues go again for the new end; prompts and clicks carry on
+    audio_cancel(TAG_BEEP);
+    audio_cancel(TAG_COUNTDOWN);
+
+    state->session_ns = interval_set.total_ns;
+    state->program_version = interval_set.version;
+    state->input_ns = input->time_ns;
+    publish_state(state);
+    state->input_ns = 0;
+}
+
+int wait_for_start(int64_t start_ns, int64_t elapsed_ns) {
+    // Everything is open and the screen counts down to the start while this
+    // thread sleeps in the event loop. The wall clock may be stepped while
+    // we wait, so the gap to the start is taken afresh on every wakeup.
+    FrameState state;
+    memset(&state, 0, sizeof(state));
+    state.phase = PHASE_WAITING;
+    state.interval = current_interval;
+    state.elapsed_before_ns = elapsed_ns;
+    state.session_ns = interval_set.total_ns;
+    state.program_version = interval_set.version;
+    state.flash_ns = INT64_MAX;
+    audio_set_paused(1); // Music waits for the start too
+
+    InputEvent input;
+    while (running) {
+        int64_t now = monotonic_ns();
+        int64_t start = now + (start_ns - realtime_ns());
+        if (start - now <= START_AT_LEAD_NS) break;
+        if (llabs(start - state.interval_end_ns) > NSEC_PER_MSEC) {
+            if (start - now > state.interval_ns) state.interval_ns = start - now;
+            state.interval_end_ns = start;
+            publish_state(&state);
+        }
+
+        // Only quitting counts; the screen says other keys do nothing yet,
+        // and the control socket refuses them
+        int64_t wake = start - START_AT_LEAD_NS;
+        if (wake > now + NSEC_PER_SEC) wake = now + NSEC_PER_SEC;
+        if (wait_for_command(wake, &input) == CMD_QUIT) {
+            running = 0;
+        }
+    }
+
+    // The last stretch sleeps on the wall clock itself, without slack, so
+    // the session starts on the very instant asked for
+    if (running) {
+        struct timespec ts = { start_ns / NSEC_PER_SEC, start_ns % NSEC_PER_SEC };
+        prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR && running) {
+            // Interrupted by a signal; sleep on unless it was one to quit
+        }
+        stats.start_error_ns = realtime_ns() - start_ns;
+        prctl(PR_SET_TIMERSLACK, low_power ? LOW_POWER_TIMER_SLACK_NS : 0, 0, 0, 0);
+    }
+    audio_set_paused(0);
+    return running;
+}
+
+int hold_until(int64_t deadline_ns) {
+    // Only quitting means anything while the boundary plays out; anything
+    // else stays queued for the next interval to act on, as if pressed
+    // when it starts
+    while (running && !input_queued(CMD_QUIT)) {
+        if (monotonic_ns() >= deadline_ns) return CMD_NONE;
+        wait_for_events(deadline_ns);
+        poll_x11_input();
+    }
+    return CMD_QUIT;
+}
+
+void load_intervals(IntervalSet *set, const char *filename) {
+    set->count = 0;
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("Error: Cannot open file %s\n", filename);
+        return;
+    }
+
+    char line[256];
+    
+    while (fgets(line, sizeof(line), file) && set->count < MAX_INTERVALS) {
+        char label[MAX_LABEL_LENGTH];
+        char duration_text[32];
+        int duration_ms;
+        int duration_end = 0;
+        
+        if (sscanf(line, "%49s %31s%n", label, duration_text, &duration_end) == 2) {
+            if (parse_duration(duration_text, &duration_ms) < 0) {
+                // Lines that don't look like a duration at all are comments
+                if (isdigit((unsigned char)duration_text[0])) {
+                    printf("Warning: Ignoring bad duration %s for %s\n", duration_text, label);
+                }
+                continue;
+            }
+
+            // Optional cadence after the duration, e.g. "Sprint 30 @110bpm";
+            // an '@' in the label is just part of the label
+            int bpm = 0;
+            char *cadence = strchr(line + duration_end, '@');
+            if (cadence && (sscanf(cadence, "@%dbpm", &bpm) != 1 || bpm < 1 || bpm > 600)) {
+                printf("Warning: Ignoring bad cadence for %s\n", label);
+                bpm = 0;
+            }
+
+            strncpy(set->intervals[set->count].label, label, MAX_LABEL_LENGTH - 1);
+            set->intervals[set->count].label[MAX_LABEL_LENGTH - 1] = '\0';
+            set->intervals[set->count].duration_ms = duration_ms;
+            set->intervals[set->count].bpm = bpm;
+            set->count++;
+        }
+    }
+    
+    fclose(file);
+    build_interval_index(set);
+}
+
+uint64_t hash_program(const IntervalSet *set) {
+    // Identifies the intervals as loaded, so a checkpoint only resumes
+    // the very program it was written for
+    uint64_t id = fnv1a(0xcbf29ce484222325ULL, &set->count, sizeof(set->count));
+    for (int i = 0; i < set->count; i++) {
+        const Interval *interval = &set->intervals[i];
+        id = fnv1a(id, interval->label, strlen(interval->label));
+        id = fnv1a(id, &interval->duration_ms, sizeof(interval->duration_ms));
+    }
+    return id;
+}
+
+int load_program(const char *filename) {
+    // Parsed aside, so the renderer only ever waits for the swap; an empty
+    // or unreadable file leaves the old program in place
+    static IntervalSet loaded;
+    load_intervals(&loaded, filename);
+    if (loaded.count == 0) return -1;
+    uint64_t id = hash_program(&loaded);
+
+    pthread_mutex_lock(&program_lock);
+    loaded.version = interval_set.version + 1;
+    interval_set = loaded;
+    program_id = id;
+    program_edits = 0;
+    pthread_mutex_unlock(&program_lock);
+    return 0;
+}
+
+int parse_start_time(const char *text, int64_t *start_ns) {
+    // Local wall-clock time, "18:00", "18:00:30" or "18:00:30.250", the
+    // next time it comes round; or on a given day, "2026-10-17 18:00"
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int dated = 0;
+    int year, month, day, used = 0;
+    if (sscanf(text, "%4d-%2d-%2d%n", &year, &month, &day, &used) == 3 && (text[used] == ' ' || text[used] == 'T')) {
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        text += used + 1;
+        dated = 1;
+    }
+
+    int hour, minute;
+    long second = 0;
+    if (!isdigit((unsigned char)text[0]) || sscanf(text, "%2d:%2d%n", &hour, &minute, &used) != 2) return -1;
+    char *end = (char *)text + used;
+    if (*end == ':') {
+        if (!isdigit((unsigned char)end[1])) return -1;
+        second = strtol(end + 1, &end, 10);
+    }
+    long long ms = 0;
+    if (*end == '.') {
+        const char *p = end + 1;
+        if (!isdigit((unsigned char)*p)) return -1;
+        for (int scale = 100; isdigit((unsigned char)*p); p++, scale /= 10) {
+            ms += (*p - '0') * scale;
+        }
+        end = (char *)p;
+    }
+    if (*end != '\0' || hour > 23 || minute > 59 || second > 59) return -1;
+
+    tm.tm_hour = hour;
+    tm.tm_min = minute;
+    tm.tm_sec = (int)second;
+    tm.tm_isdst = -1;  // Whatever daylight saving says for that day
+    time_t start = mktime(&tm);
+    if (start == (time_t)-1) return -1;
+    if (!dated && (int64_t)start * NSEC_PER_SEC + ms * NSEC_PER_MSEC <= realtime_ns()) {
+        tm.tm_mday++;
+        tm.tm_hour = hour;
+        tm.tm_min = minute;
+        tm.tm_sec = (int)second;
+        tm.tm_isdst = -1;
+        start = mktime(&tm);
+    }
+    *start_ns = (int64_t)start * NSEC_PER_SEC + ms * NSEC_PER_MSEC;
+    return 0;
+}
+
+int parse_duration(const char *text, int *duration_ms) {
+    // Seconds with an optional fraction, "45" or "7.5", optionally after
+    // minutes, "1:30.5". All integer, so a long program adds up exactly;
+    // digits past milliseconds are dropped.
+    if (!isdigit((unsigned char)text[0])) return -1;
+    char *end;
+    long long minutes = 0;
+    long long seconds = strtoll(text, &end, 10);
+    if (*end == ':') {
+        minutes = seconds;
+        if (!isdigit((unsigned char)end[1])) return -1;
+        seconds = strtoll(end + 1, &end, 10);
+        if (seconds >= 60) return -1;
+    }
+
+    long long ms = 0;
+    if (*end == '.') {
+        const char *p = end + 1;
+        if (!isdigit((unsigned char)*p)) return -1;
+        for (int scale = 100; isdigit((unsigned char)*p); p++, scale /= 10) {
+            ms += (*p - '0') * scale;
+        }
+        end = (char *)p;
+    }
+    if (*end != '\0' || minutes > 24 * 60 || seconds > 24 * 3600) return -1;
+
+    long long total = (minutes * 60 + seconds) * 1000 + ms;
+    if (total <= 0) return -1;
+    *duration_ms = (int)total;
+    return 0;
+}
+
+void build_interval_index(IntervalSet *set) {
+    // Each node adds itself into its parent, so the whole tree is O(n)
+    memset(set->tree, 0, sizeof(set->tree));
+    set->total_ns = 0;
+    for (int k = 1; k <= set->count; k++) {
+        int64_t duration_ns = set->intervals[k - 1].duration_ms * NSEC_PER_MSEC;
+        set->tree[k] += duration_ns;
+        set->total_ns += duration_ns;
+        int parent = k + (k & -k);
+        if (parent <= set->count) {
+            set->tree[parent] += set->tree[k];
+        }
+    }
+}
+
+void index_add(int i, int64_t delta_ns) {
+    // Interval i's duration changed by delta_ns
+    for (int k = i + 1; k <= interval_set.count; k += k & -k) {
+        interval_set.tree[k] += delta_ns;
+    }
+    interval_set.total_ns += delta_ns;
+}
+
+int64_t interval_start_ns(int i) {
+    // Sum of the durations before interval i
+    int64_t sum = 0;
+    for (int k = i; k > 0; k -= k & -k) {
+        sum += interval_set.tree[k];
+    }
+    return sum;
+}
+
+int find_interval(int64_t elapsed_ns) {
+    // Walk down the tree to the last interval starting at or before elapsed_ns
+    int step = 1;
+    while (step * 2 <= interval_set.count) step *= 2;
+
+    int pos = 0;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= interval_set.count && interval_set.tree[pos + step] <= elapsed_ns) {
+            pos += step;
+            elapsed_ns -= interval_set.tree[pos];
+        }
+    }
+    return pos < interval_set.count ? pos : interval_set.count - 1;
+}
+
+int insert_interval(int at, const char *label, int duration_ms) {
+    if (interval_set.count == MAX_INTERVALS) {
+        printf("Warning: Program is full, not inserting %s\n", label);
+        return -1;
+    }
+
+    // Every later interval moves up one, so the tree is rebuilt along with them
+    memmove(&interval_set.intervals[at + 1], &interval_set.intervals[at],
+            (interval_set.count - at) * sizeof(Interval));
+    Interval *interval = &interval_set.intervals[at];
+    strncpy(interval->label, label, MAX_LABEL_LENGTH - 1);
+    interval->label[MAX_LABEL_LENGTH - 1] = '\0';
+    interval->duration_ms = duration_ms;
+    interval->bpm = 0;
+    interval_set.count++;
+    build_interval_index(&interval_set);
+    return 0;
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void open_checkpoint() {
+    char path[512];
+    if (!checkpoint_file) {
+        checkpoint_file = home_file(path, sizeof(path), ".interval_timer_checkpoint");
+        if (!checkpoint_file) return;
+    }
+
+    int fd = open(checkpoint_file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Warning: Cannot open checkpoint %s: %s\n", checkpoint_file, strerror(errno));
+        checkpoint_file = NULL;
+        return;
+    }
+
+    // Two timers writing one checkpoint would resume each other's position
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        printf("Warning: Checkpoint %s is in use by another timer, not keeping the position (use --checkpoint)\n",
+               checkpoint_file);
+        close(fd);
+        checkpoint_file = NULL;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size != (off_t)sizeof(CheckpointFile)) {
+        // New, or from a different layout: start from zeroes
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(CheckpointFile)) < 0) {
+            printf("Warning: Cannot size checkpoint %s: %s\n", checkpoint_file, strerror(errno));
+        }
+    }
+    void *map = mmap(NULL, sizeof(CheckpointFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    checkpoint_file = NULL; // May point at this stack frame; not needed past here
+    if (map == MAP_FAILED) {
+        printf("Warning: Cannot map checkpoint: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    checkpoint_fd = fd;
+
+    checkpoint = map;
+    if (checkpoint->magic != CHECKPOINT_MAGIC || checkpoint->size != sizeof(CheckpointFile)) {
+        memset(checkpoint, 0, sizeof(CheckpointFile));
+        checkpoint->magic = CHECKPOINT_MAGIC;
+        checkpoint->size = sizeof(CheckpointFile);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (checkpoint->slots[i].sequence > checkpoint_sequence) {
+            checkpoint_sequence = checkpoint->slots[i].sequence;
+        }
+    }
+}
+
+void close_checkpoint() {
+    if (!checkpoint) return;
+
+    // Nothing else will touch it, so wait for this one to reach the disk
+    msync(checkpoint, sizeof(CheckpointFile), MS_SYNC);
+    munmap(checkpoint, sizeof(CheckpointFile));
+    checkpoint = NULL;
+    close(checkpoint_fd);
+    checkpoint_fd = -1;
+}
+
+int read_checkpoint(int *interval, int64_t *offset_ns) {
+    if (!checkpoint) return 0;
+
+    // Newest slot that is whole and belongs to this program
+    const CheckpointSlot *best = NULL;
+    for (int i = 0; i < 2; i++) {
+        const CheckpointSlot *slot = &checkpoint->slots[i];
+        if (slot->sequence == 0 || slot->program != program_id) continue;
+        if (slot->check != fnv1a(0xcbf29ce484222325ULL, slot, offsetof(CheckpointSlot, check))) continue;
+        if (!best || slot->sequence > best->sequence) best = slot;
+    }
+    if (!best || best->finished) return 0;
+    if (best->edits > CHECKPOINT_MAX_EDITS) {
+        printf("Warning: The last session was edited too often to resume\n");
+        return 0;
+    }
+    if (replay_edits(best->edits) < 0) {
+        printf("Warning: The checkpoint's edits are damaged, not resuming\n");
+        return 0;
+    }
+    if (best->interval < 0 || best->interval >= interval_set.count) return 0;
 
-    // Draw interval label
-    cairo_set_font_size(cr, 64);
-    cairo_text_extents(cr, label, &extents);
-    cairo_move_to(cr, (screen_width - extents.width) / 2, 200);
-    cairo_show_text(cr, label);
+    int64_t duration_ns = interval_set.intervals[best->interval].duration_ms * NSEC_PER_MSEC;
+    *interval = best->interval;
+    *offset_ns = best->offset_ns < 0 ? 0 : best->offset_ns;
+    if (*offset_ns >= duration_ns) *offset_ns = duration_ns - 1;
+    return 1;
+}
 
-    // Draw timer
-    char time_str[10];
-    snprintf(time_str, sizeof(time_str), "%02d:%02d", minutes, seconds);
-    cairo_set_font_size(cr, 300);
-    cairo_text_extents(cr, time_str, &extents);
-    cairo_move_to(cr, (screen_width - extents.width) / 2, (screen_height + extents.height) / 2);
-    cairo_show_text(cr, time_str);
-
-    // Draw progress bars
-    int bar_width = screen_width * 0.8;
-    int bar_height = 16; // Thicker bars
-    int margin = (screen_width - bar_width) / 2;
-    
-    // Overall training progress bar (top)
-    int overall_progress_y = screen_height - 280;
-    float overall_progress = (float)elapsed_training_time / total_training_time;
-    
-    // Draw overall progress bar background
-    cairo_set_source_rgb(cr, 0.2, 0.2, 0.2); // Dark gray background
-    cairo_rectangle(cr, margin, overall_progress_y, bar_width, bar_height);
-    cairo_fill(cr);
-    
-    // Draw overall progress bar fill
-    cairo_set_source_rgb(cr, 0.0, 0.8, 0.0); // Green progress
-    cairo_rectangle(cr, margin, overall_progress_y, bar_width * overall_progress, bar_height);
-    cairo_fill(cr);
-    
-    // Draw overall progress ticks (bigger and more visible)
-    cairo_set_source_rgb(cr, 0.8, 0.8, 0.8); // Bright white ticks
-    cairo_set_line_width(cr, 3.0); // Thicker tick lines
-    for (int i = 1; i < interval_set.count; i++) {
-        float tick_pos = 0;
-        for (int j = 0; j < i; j++) {
-            tick_pos += (float)interval_set.intervals[j].duration / total_training_time;
-        }
-        int x = margin + (int)(bar_width * tick_pos);
-        cairo_move_to(cr, x, overall_progress_y - 8);
-        cairo_line_to(cr, x, overall_progress_y + bar_height + 8);
-        cairo_stroke(cr);
+void record_edit(int command, int interval, int duration_ms) {
+    // Called with program_lock held, ahead of the version bump that lets
+    // the renderer count this edit in a slot
+    uint32_t n = program_edits++;
+    if (!checkpoint || n > CHECKPOINT_MAX_EDITS) return;
+    if (n == CHECKPOINT_MAX_EDITS) {
+        printf("Warning: Too many edits to keep, --resume will not continue this session\n");
+        return;
     }
-    
-    // Current interval progress bar (bottom)
-    int current_progress_y = screen_height - 220;
-    Interval *current_interval_ptr = &interval_set.intervals[current_interval];
-    float current_progress = 1.0 - ((float)time_remaining / current_interval_ptr->duration);
-    
-    // Draw current interval progress bar background
-    cairo_set_source_rgb(cr, 0.2, 0.2, 0.2); // Dark gray background
-    cairo_rectangle(cr, margin, current_progress_y, bar_width, bar_height);
-    cairo_fill(cr);
-    
-    // Draw current interval progress bar fill
-    cairo_set_source_rgb(cr, 0.0, 0.6, 1.0); // Blue progress
-    cairo_rectangle(cr, margin, current_progress_y, bar_width * current_progress, bar_height);
-    cairo_fill(cr);
-    
-    // Draw progress labels (bigger text)
-    cairo_set_font_size(cr, 28); // Bigger font
-    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0); // Bright white text
-    
-    // Overall progress label
-    char overall_label[64];
-    snprintf(overall_label, sizeof(overall_label), "Training: %d/%d intervals", current_interval + 1, interval_set.count);
-    cairo_text_extents(cr, overall_label, &extents);
-    cairo_move_to(cr, margin, overall_progress_y - 20);
-    cairo_show_text(cr, overall_label);
-    
-    // Current interval label (positioned to avoid overlap)
-    char current_label[64];
-    snprintf(current_label, sizeof(current_label), "Current: %s", label);
-    cairo_text_extents(cr, current_label, &extents);
-    cairo_move_to(cr, margin, current_progress_y - 20);
-    cairo_show_text(cr, current_label);
-    
-    // Show next interval preview during last 30 seconds
-    if (time_remaining <= 30 && current_interval + 1 < interval_set.count) {
-        Interval *next_interval = &interval_set.intervals[current_interval + 1];
-        char next_label[64];
-        snprintf(next_label, sizeof(next_label), "Next: %s", next_interval->label);
-        
-        // Use larger font and bright color for better visibility
-        cairo_set_font_size(cr, 32);
-        cairo_set_source_rgb(cr, 1.0, 1.0, 0.0); // Bright yellow for visibility
-        
-        cairo_text_extents(cr, next_label, &extents);
-        cairo_move_to(cr, margin, current_progress_y + 60);
-        cairo_show_text(cr, next_label);
-        
-        // Reset font size for other text
-        cairo_set_font_size(cr, 28);
-        cairo_set_source_rgb(cr, 1.0, 1.0, 1.0); // Back to white
+
+    CheckpointEdit *edit = &checkpoint->edits[n];
+    edit->program = program_id;
+    edit->command = command;
+    edit->interval = interval;
+    edit->duration_ms = duration_ms;
+    edit->unused = 0;
+    edit->check = fnv1a(0xcbf29ce484222325ULL, edit, offsetof(CheckpointEdit, check));
+}
+
+int replay_edits(uint32_t count) {
+    // Check the whole log before touching the program, so a bad entry
+    // leaves it as loaded
+    for (uint32_t i = 0; i < count; i++) {
+        const CheckpointEdit *edit = &checkpoint->edits[i];
+        if (edit->program != program_id ||
+            edit->check != fnv1a(0xcbf29ce484222325ULL, edit, offsetof(CheckpointEdit, check))) {
+            return -1;
+        }
     }
 
-    // Draw instructions
-    cairo_set_font_size(cr, 24);
-    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0); // White text
-    const char *instructions[] = {
-        "Press 'S' to skip interval",
-        "Press 'Q' or 'ESC' to quit",
-        "Intervals continue automatically"
-    };
-    
-    for (int i = 0; i < 2; i++) {
-        cairo_text_extents(cr, instructions[i], &extents);
-        cairo_move_to(cr, (screen_width - extents.width) / 2, screen_height - 150 + i * 40);
-        cairo_show_text(cr, instructions[i]);
+    static IntervalSet loaded;
+    loaded = interval_set;
+    for (uint32_t i = 0; i < count; i++) {
+        const CheckpointEdit *edit = &checkpoint->edits[i];
+        int ok;
+        if (edit->command == CMD_ADJUST) {
+            ok = edit->interval >= 0 && edit->interval < interval_set.count && edit->duration_ms > 0;
+            if (ok) interval_set.intervals[edit->interval].duration_ms = edit->duration_ms;
+        } else {
+            ok = edit->command == CMD_INSERT_REST && edit->interval >= 0 && edit->interval <= interval_set.count &&
+                 insert_interval(edit->interval, "Rest", edit->duration_ms) == 0;
+        }
+        if (!ok) {
+            interval_set = loaded;
+            return -1;
+        }
     }
+    build_interval_index(&interval_set);
+    program_edits = count; // Later edits go on the end of the log
+    return 0;
+}
 
-    // Update display
-    cairo_surface_flush(surface);
-    XFlush(display);
+void write_checkpoint(uint64_t program, uint32_t edits, int interval, int64_t offset_ns, int finished) {
+    if (!checkpoint) return;
+
+    // Overwrite the older slot; the newer one stands until this is done
+    checkpoint_sequence++;
+    CheckpointSlot *slot = &checkpoint->slots[checkpoint_sequence % 2];
+    slot->sequence = checkpoint_sequence;
+    slot->program = program;
+    slot->edits = edits;
+    slot->interval = interval;
+    slot->finished = finished;
+    slot->offset_ns = offset_ns;
+    uint64_t check = fnv1a(0xcbf29ce484222325ULL, slot, offsetof(CheckpointSlot, check));
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The check lands last
+    slot->check = check;
+
+    // Stores alone survive a crash of this process; writeback is only
+    // asked for now and then, and never waited on
+    int64_t now = monotonic_ns();
+    if (now - checkpoint_synced_ns >= CHECKPOINT_SYNC_NS) {
+        msync(checkpoint, sizeof(CheckpointFile), MS_ASYNC);
+        checkpoint_synced_ns = now;
+    }
 }
 
-void draw_completion_message(const char *label) {
-    if (!cr) return;
+void checkpoint_state(const FrameState *state, int64_t now) {
+    // Nothing has run before a scheduled start; keep what was there
+    if (state->phase == PHASE_WAITING) return;
 
-    // Flash effect
-    for (int i = 0; i < 3; i++) {
-        // White flash
-        cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
-        cairo_paint(cr);
-        cairo_surface_flush(surface);
-        XFlush(display);
-        usleep(200000);
+    // A completed interval resumes at the start of the next one
+    if (state->phase == PHASE_COMPLETE) {
+        write_checkpoint(program_view.id, program_view.edits, state->interval + 1, 0, state->interval + 1 >= program_view.count);
+        return;
+    }
+    if (state->phase == PHASE_PAUSED) {
+        now = state->paused_at_ns;
+    }
+    int64_t offset_ns = state->interval_ns - (state->interval_end_ns - now);
+    if (offset_ns < 0) offset_ns = 0;
+    if (offset_ns >= state->interval_ns) offset_ns = state->interval_ns - 1;
+    write_checkpoint(program_view.id, program_view.edits, state->interval, offset_ns, 0);
+}
 
-        // Red flash
-        cairo_set_source_rgb(cr, 1.0, 0.0, 0.0);
-        cairo_paint(cr);
-        cairo_surface_flush(surface);
-        XFlush(display);
-        usleep(200000);
+const char *home_file(char *buf, size_t size, const char *name) {
+    const char *home = getenv("HOME");
+    if (!home) return NULL;
+    snprintf(buf, size, "%s/%s", home, name);
+    return buf;
+}
+
+void start_history() {
+    char path[512];
+    const char *file = history_file ? history_file : home_file(path, sizeof(path), ".interval_timer_history");
+    if (!file) return;
+
+    history.fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (history.fd < 0) {
+        printf("Warning: Cannot open history %s: %s\n", file, strerror(errno));
+        return;
     }
 
-    // Draw completion message
-    cairo_set_source_rgb(cr, 0.0, 0.0, 0.0); // Black background
-    cairo_paint(cr);
+    // A crash part way through a write leaves a partial record at the
+    // end; cut it off so everything after lines up again
+    struct stat st;
+    if (fstat(history.fd, &st) == 0 && st.st_size % sizeof(HistoryRecord) != 0) {
+        if (ftruncate(history.fd, st.st_size - st.st_size % sizeof(HistoryRecord)) < 0) {
+            printf("Warning: Cannot repair history %s: %s\n", file, strerror(errno));
+        }
+    }
 
-    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0); // White text
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&history.wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&history.lock, NULL);
 
-    // Draw completion text
-    cairo_set_font_size(cr, 48);
-    const char *completion_text = "INTERVAL COMPLETE!";
-    cairo_text_extents_t extents;
-    cairo_text_extents(cr, completion_text, &extents);
-    cairo_move_to(cr, (screen_width - extents.width) / 2, screen_height / 2 - 100);
-    cairo_show_text(cr, completion_text);
+    history.session = time(NULL);
+    history.running = 1;
+    // File writes may block, so they never happen on the timer thread
+    if (start_thread(&history.thread, history_thread_main, 0, "history") != 0) {
+        printf("Warning: Cannot start history thread\n");
+        close(history.fd);
+        return;
+    }
+    history.started = 1;
+}
 
-    // Draw interval name
-    cairo_set_font_size(cr, 36);
-    cairo_text_extents(cr, label, &extents);
-    cairo_move_to(cr, (screen_width - extents.width) / 2, screen_height / 2);
-    cairo_show_text(cr, label);
+void stop_history() {
+    if (!history.started) return;
 
-    // Draw continue instruction
-    cairo_set_font_size(cr, 24);
-    const char *continue_text = "Continuing automatically in 2 seconds...";
-    cairo_text_extents(cr, continue_text, &extents);
-    cairo_move_to(cr, (screen_width - extents.width) / 2, screen_height / 2 + 100);
-    cairo_show_text(cr, continue_text);
+    pthread_mutex_lock(&history.lock);
+    history.running = 0;
+    pthread_cond_signal(&history.wake);
+    pthread_mutex_unlock(&history.lock);
+    pthread_join(history.thread, NULL);
 
-    cairo_surface_flush(surface);
-    XFlush(display);
+    fdatasync(history.fd);
+    close(history.fd);
+    if (history.dropped > 0) {
+        printf("Warning: %ld history records dropped\n", history.dropped);
+    }
+    history.started = 0;
 }
 
-void flash_screen() {
-    if (!cr) return;
-    
-    for (int i = 0; i < 3; i++) {
-        // White flash
-        cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
-        cairo_paint(cr);
-        cairo_surface_flush(surface);
-        XFlush(display);
-        usleep(200000);
-        
-        // Red flash
-        cairo_set_source_rgb(cr, 1.0, 0.0, 0.0);
-        cairo_paint(cr);
-        cairo_surface_flush(surface);
-        XFlush(display);
-        usleep(200000);
+void push_history(HistoryRecord *record) {
+    if (!history.started) return;
+
+    record->magic = HISTORY_MAGIC;
+    record->session = history.session;
+    record->time = time(NULL);
+    record->check = (uint32_t)fnv1a(0xcbf29ce484222325ULL, record, offsetof(HistoryRecord, check));
+
+    pthread_mutex_lock(&history.lock);
+    if (history.count == HISTORY_QUEUE_SIZE) {
+        history.dropped++;
+    } else {
+        history.queue[history.count++] = *record;
+        if (history.count >= HISTORY_BATCH) {
+            pthread_cond_signal(&history.wake);
+        }
     }
+    pthread_mutex_unlock(&history.lock);
 }
 
-void load_intervals(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: Cannot open file %s\n", filename);
-        return;
+void history_interval(int index, int flags, int64_t ran_ns, int64_t paused_ns) {
+    Interval *interval = &interval_set.intervals[index];
+    HistoryRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = HISTORY_INTERVAL;
+    record.flags = flags;
+    record.index = index;
+    record.planned_ms = interval->duration_ms;
+    record.actual_ms = (int32_t)(ran_ns / NSEC_PER_MSEC);
+    record.paused_ms = (int32_t)(paused_ns / NSEC_PER_MSEC);
+    strncpy(record.label, interval->label, HISTORY_LABEL_LENGTH - 1);
+    push_history(&record);
+}
+
+void history_session(int flags, int completed, int64_t ran_ns, int64_t paused_ns) {
+    HistoryRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = HISTORY_SESSION;
+    record.flags = flags;
+    record.index = completed;
+    record.planned_ms = (int32_t)(interval_set.total_ns / NSEC_PER_MSEC);
+    record.actual_ms = (int32_t)(ran_ns / NSEC_PER_MSEC);
+    record.paused_ms = (int32_t)(paused_ns / NSEC_PER_MSEC);
+    push_history(&record);
+}
+
+void *history_thread_main(void *arg) {
+    (void)arg;
+    HistoryRecord batch[HISTORY_QUEUE_SIZE];
+
+    pthread_mutex_lock(&history.lock);
+    while (history.running || history.count > 0) {
+        // Records come in at interval boundaries; let a few gather, but
+        // none waits longer than HISTORY_FLUSH_NS
+        if (history.running && history.count == 0) {
+            pthread_cond_wait(&history.wake, &history.lock);
+        } else if (history.running && history.count < HISTORY_BATCH) {
+            struct timespec ts;
+            int64_t wake_ns = monotonic_ns() + HISTORY_FLUSH_NS;
+            ts.tv_sec = wake_ns / NSEC_PER_SEC;
+            ts.tv_nsec = wake_ns % NSEC_PER_SEC;
+            pthread_cond_timedwait(&history.wake, &history.lock, &ts);
+        }
+
+        int count = history.count;
+        memcpy(batch, history.queue, count * sizeof(HistoryRecord));
+        history.count = 0;
+        pthread_mutex_unlock(&history.lock);
+
+        // One append per batch; O_APPEND keeps whole records together
+        size_t size = count * sizeof(HistoryRecord);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = write(history.fd, (char *)batch + done, size - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                printf("Warning: Cannot write history: %s\n", strerror(errno));
+                break;
+            }
+            done += n;
+        }
+        pthread_mutex_lock(&history.lock);
     }
+    pthread_mutex_unlock(&history.lock);
+    return NULL;
+}
 
-    interval_set.count = 0;
-    total_training_time = 0;
-    char line[256];
-    
-    while (fgets(line, sizeof(line), file) && interval_set.count < MAX_INTERVALS) {
-        char label[MAX_LABEL_LENGTH];
-        int duration;
-        
-        if (sscanf(line, "%s %d", label, &duration) == 2) {
-            strncpy(interval_set.intervals[interval_set.count].label, label, MAX_LABEL_LENGTH - 1);
-            interval_set.intervals[interval_set.count].label[MAX_LABEL_LENGTH - 1] = '\0';
-            interval_set.intervals[interval_set.count].duration = duration;
-            total_training_time += duration;
-            interval_set.count++;
+int32_t history_week(int64_t time_s) {
+    // Weeks start on Monday, local time; 1970-01-01 was a Thursday
+    struct tm local;
+    time_t t = time_s;
+    localtime_r(&t, &local);
+    int64_t days = (time_s + local.tm_gmtoff) / 86400;
+    return (int32_t)((days + 3) / 7);
+}
+
+uint32_t *find_history_label(const HistoryIndex *index, const char *label) {
+    // The label's slot, or the empty one it would go in
+    uint32_t mask = index->label_slots - 1;
+    uint32_t slot = (uint32_t)fnv1a(0xcbf29ce484222325ULL, label, strlen(label)) & mask;
+    while (index->label_slot[slot] && strcmp(index->label[index->label_slot[slot] - 1], label) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &index->label_slot[slot];
+}
+
+int grow_history_labels(HistoryIndex *index) {
+    // Rehashed from the label column, which is all a loaded index has
+    uint32_t slots = index->label_slots ? index->label_slots * 2 : 256;
+    while (slots < 2 * (index->labels + 1)) slots *= 2;
+    uint32_t *label_slot = calloc(slots, sizeof(uint32_t));
+    if (!label_slot) return -1;
+    free(index->label_slot);
+    index->label_slot = label_slot;
+    index->label_slots = slots;
+    for (uint32_t id = 0; id < index->labels; id++) {
+        *find_history_label(index, index->label[id]) = id + 1;
+    }
+    return 0;
+}
+
+int index_history_record(HistoryIndex *index, const HistoryRecord *record) {
+    // Out of memory leaves the index as it was before this record
+    if (record->magic != HISTORY_MAGIC ||
+        record->check != (uint32_t)fnv1a(0xcbf29ce484222325ULL, record, offsetof(HistoryRecord, check))) {
+        index->records++;
+        return 0; // Damaged, skip it but keep counting
+    }
+
+    if (record->type == HISTORY_SESSION) {
+        if (index->sessions == index->session_capacity) {
+            size_t capacity = index->session_capacity ? index->session_capacity * 2 : 256;
+            int32_t *session_week = realloc(index->session_week, capacity * sizeof(int32_t));
+            if (!session_week) return -1;
+            index->session_week = session_week;
+            index->session_capacity = capacity;
         }
+        index->session_week[index->sessions++] = history_week(record->session);
+        index->records++;
+        return 0;
+    }
+
+    // Labels are interned, so the columns stay small and fixed-width
+    char label[HISTORY_LABEL_LENGTH];
+    memcpy(label, record->label, HISTORY_LABEL_LENGTH);
+    label[HISTORY_LABEL_LENGTH - 1] = '\0';
+    if (index->label_slots < 2 * (index->labels + 1) && grow_history_labels(index) < 0) return -1;
+    uint32_t *slot = find_history_label(index, label);
+    if (!*slot) {
+        if (index->labels == 65535) {
+            index->records++;
+            return 0;
+        }
+        char (*labels)[HISTORY_LABEL_LENGTH] = realloc(index->label, (index->labels + 1) * sizeof(*index->label));
+        if (!labels) return -1;
+        index->label = labels;
+        memcpy(index->label[index->labels++], label, HISTORY_LABEL_LENGTH);
+        *slot = index->labels;
+    }
+    uint32_t id = *slot - 1;
+
+    // Columns that did grow are kept; the capacity only counts once all have
+    if (index->rows == index->row_capacity) {
+        size_t capacity = index->row_capacity ? index->row_capacity * 2 : 1024;
+        int32_t *week = realloc(index->week, capacity * sizeof(int32_t));
+        if (!week) return -1;
+        index->week = week;
+        int32_t *actual_ms = realloc(index->actual_ms, capacity * sizeof(int32_t));
+        if (!actual_ms) return -1;
+        index->actual_ms = actual_ms;
+        uint16_t *label_id = realloc(index->label_id, capacity * sizeof(uint16_t));
+        if (!label_id) return -1;
+        index->label_id = label_id;
+        uint8_t *flags = realloc(index->flags, capacity * sizeof(uint8_t));
+        if (!flags) return -1;
+        index->flags = flags;
+        index->row_capacity = capacity;
+    }
+    index->week[index->rows] = history_week(record->session);
+    index->actual_ms[index->rows] = record->actual_ms;
+    index->label_id[index->rows] = (uint16_t)id;
+    index->flags[index->rows] = (uint8_t)record->flags;
+    index->rows++;
+    index->records++;
+    return 0;
+}
+
+int load_history_index(HistoryIndex *index, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+
+    // The sizes must account for the whole file, or the index is damaged
+    // or from something else and gets rebuilt from the log
+    HistoryIndexHeader header;
+    struct stat st;
+    uint64_t size = fstat(fileno(file), &st) == 0 ? (uint64_t)st.st_size : 0;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == HISTORY_INDEX_MAGIC &&
+             header.labels <= 65535 && header.rows <= size && header.sessions <= size &&
+             header.rows + header.sessions <= header.records &&
+             sizeof(header) + header.labels * sizeof(*index->label) +
+             header.rows * (2 * sizeof(int32_t) + sizeof(uint16_t) + sizeof(uint8_t)) +
+             header.sessions * sizeof(int32_t) == size;
+    if (ok) {
+        index->records = header.records;
+        index->labels = header.labels;
+        index->rows = index->row_capacity = header.rows;
+        index->sessions = index->session_capacity = header.sessions;
+        index->label = malloc(header.labels * sizeof(*index->label) + 1);
+        index->week = malloc(header.rows * sizeof(int32_t) + 1);
+        index->actual_ms = malloc(header.rows * sizeof(int32_t) + 1);
+        index->label_id = malloc(header.rows * sizeof(uint16_t) + 1);
+        index->flags = malloc(header.rows + 1);
+        index->session_week = malloc(header.sessions * sizeof(int32_t) + 1);
+        ok = index->label && index->week && index->actual_ms && index->label_id && index->flags &&
+             index->session_week &&
+             fread(index->label, sizeof(*index->label), header.labels, file) == header.labels &&
+             fread(index->week, sizeof(int32_t), header.rows, file) == header.rows &&
+             fread(index->actual_ms, sizeof(int32_t), header.rows, file) == header.rows &&
+             fread(index->label_id, sizeof(uint16_t), header.rows, file) == header.rows &&
+             fread(index->flags, sizeof(uint8_t), header.rows, file) == header.rows &&
+             fread(index->session_week, sizeof(int32_t), header.sessions, file) == header.sessions;
+    }
+    for (size_t i = 0; ok && i < header.rows; i++) {
+        if (index->label_id[i] >= header.labels) ok = 0;
+    }
+    for (uint32_t l = 0; ok && l < header.labels; l++) {
+        index->label[l][HISTORY_LABEL_LENGTH - 1] = '\0';
     }
-    
     fclose(file);
+    return ok ? 0 : -1;
+}
+
+int save_history_index(const HistoryIndex *index, const char *path) {
+    // Written aside and renamed over, so a reader never sees half of it
+    char tmp[520];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "wb");
+    if (!file) return -1;
+
+    HistoryIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HISTORY_INDEX_MAGIC;
+    header.labels = index->labels;
+    header.records = index->records;
+    header.rows = index->rows;
+    header.sessions = index->sessions;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(index->label, sizeof(*index->label), index->labels, file);
+    fwrite(index->week, sizeof(int32_t), index->rows, file);
+    fwrite(index->actual_ms, sizeof(int32_t), index->rows, file);
+    fwrite(index->label_id, sizeof(uint16_t), index->rows, file);
+    fwrite(index->flags, sizeof(uint8_t), index->rows, file);
+    fwrite(index->session_week, sizeof(int32_t), index->sessions, file);
+    if (fclose(file) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+void free_history_index(HistoryIndex *index) {
+    free(index->label);
+    free(index->label_slot);
+    free(index->week);
+    free(index->actual_ms);
+    free(index->label_id);
+    free(index->flags);
+    free(index->session_week);
+    memset(index, 0, sizeof(*index));
+}
+
+void print_history() {
+    char path[512];
+    const char *file = history_file ? history_file : home_file(path, sizeof(path), ".interval_timer_history");
+    if (!file) return;
+    int64_t start = monotonic_ns();
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        printf("No history in %s\n", file);
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t log_records = st.st_size / sizeof(HistoryRecord);
+
+    // Fold only what was appended since the index was last saved; a log
+    // that got shorter was replaced, so start over
+    char index_path[520];
+    snprintf(index_path, sizeof(index_path), "%s.idx", file);
+    HistoryIndex index;
+    memset(&index, 0, sizeof(index));
+    if (load_history_index(&index, index_path) < 0 || index.records > log_records) {
+        free_history_index(&index);
+    }
+    uint64_t indexed = index.records;
+    if (indexed < log_records) {
+        HistoryRecord batch[256];
+        off_t offset = indexed * sizeof(HistoryRecord);
+        ssize_t n;
+        while (index.records < log_records &&
+               (n = pread(fd, batch, sizeof(batch), offset)) >= (ssize_t)sizeof(HistoryRecord)) {
+            int count = n / sizeof(HistoryRecord);
+            for (int i = 0; i < count && index.records < log_records; i++) {
+                if (index_history_record(&index, &batch[i]) < 0) {
+                    printf("Error: Out of memory indexing history %s\n", file);
+                    free_history_index(&index);
+                    close(fd);
+                    return;
+                }
+            }
+            offset += count * sizeof(HistoryRecord);
+        }
+        if (save_history_index(&index, index_path) < 0) {
+            printf("Warning: Cannot save history index %s\n", index_path);
+        }
+    }
+    close(fd);
+
+    // Everything below reads the columns only
+    int32_t first_week = INT32_MAX, last_week = INT32_MIN;
+    for (size_t i = 0; i < index.rows; i++) {
+        if (index.week[i] < first_week) first_week = index.week[i];
+        if (index.week[i] > last_week) last_week = index.week[i];
+    }
+    for (size_t i = 0; i < index.sessions; i++) {
+        if (index.session_week[i] < first_week) first_week = index.session_week[i];
+        if (index.session_week[i] > last_week) last_week = index.session_week[i];
+    }
+
+    if (first_week <= last_week) {
+        int weeks = last_week - first_week + 1;
+        int64_t *week_ms = calloc(weeks, sizeof(int64_t));
+        int *week_sessions = calloc(weeks, sizeof(int));
+        for (size_t i = 0; i < index.rows; i++) {
+            week_ms[index.week[i] - first_week] += index.actual_ms[i];
+        }
+        for (size_t i = 0; i < index.sessions; i++) {
+            week_sessions[index.session_week[i] - first_week]++;
+        }
+
+        printf("Week of       Sessions  Trained\n");
+        for (int w = 0; w < weeks; w++) {
+            if (week_ms[w] == 0 && week_sessions[w] == 0) continue;
+            time_t monday = ((int64_t)(first_week + w) * 7 - 3) * 86400;
+            struct tm day;
+            gmtime_r(&monday, &day);
+            int64_t s = week_ms[w] / 1000;
+            printf("%04d-%02d-%02d  %8d  %3d:%02d:%02d\n", day.tm_year + 1900, day.tm_mon + 1, day.tm_mday,
+                   week_sessions[w], (int)(s / 3600), (int)(s / 60 % 60), (int)(s % 60));
+        }
+        free(week_ms);
+        free(week_sessions);
+    }
+
+    if (index.labels > 0) {
+        long *done = calloc(index.labels, sizeof(long));
+        long *skipped = calloc(index.labels, sizeof(long));
+        for (size_t i = 0; i < index.rows; i++) {
+            // Seeking away leaves a row too, but the interval wasn't done,
+            // and it may be seeked through many times in one session
+            if (index.flags[i] & HISTORY_SEEKED) continue;
+            done[index.label_id[i]]++;
+            if (index.flags[i] & HISTORY_SKIPPED) skipped[index.label_id[i]]++;
+        }
+
+        printf("\nLabel                   Done  Skipped  Skip rate\n");
+        for (uint32_t l = 0; l < index.labels; l++) {
+            printf("%-20s %7ld  %7ld  %8.1f%%\n", index.label[l], done[l], skipped[l],
+                   done[l] > 0 ? 100.0 * skipped[l] / done[l] : 0.0);
+        }
+        free(done);
+        free(skipped);
+    }
+
+    printf("\n%llu records (%llu newly indexed) in %.1f ms\n", (unsigned long long)log_records,
+           (unsigned long long)(index.records - indexed), (monotonic_ns() - start) / 1e6);
+    free_history_index(&index);
 }
 
 void signal_handler(int sig) {
@@ -605,42 +5630,284 @@ void signal_handler(int sig) {
     running = 0;
 }
 
-int check_x11_keypress() {
-    if (!display) return 0;
-    
+void poll_x11_input() {
+    if (!display) return;
+
+    // Drain everything Xlib has, so a burst of keys is decoded in one go
     XEvent event;
     while (XPending(display)) {
         XNextEvent(display, &event);
-        
+
         switch (event.type) {
             case KeyPress: {
                 KeySym keysym;
                 char key[32];
                 int len = XLookupString(&event.xkey, key, sizeof(key), &keysym, NULL);
-                
-                if (len > 0) {
-                    return key[0];
-                } else if (keysym == XK_Escape) {
-                    return 27; // Escape key
+                int64_t time_ns = key_event_ns(event.xkey.time);
+
+                if (keysym == XK_Escape || (len > 0 && (key[0] == 'q' || key[0] == 'Q'))) {
+                    push_input(CMD_QUIT, 0, time_ns);
+                } else if (len > 0 && (key[0] == 's' || key[0] == 'S')) {
+                    push_input(CMD_SKIP, 0, time_ns);
+                } else if (len > 0 && (key[0] == 'p' || key[0] == 'P' || key[0] == ' ')) {
+                    push_input(CMD_PAUSE, 0, time_ns);
+                } else if (keysym == XK_Left || keysym == XK_Right) {
+                    push_input(CMD_SCRUB, keysym == XK_Left ? -SCRUB_STEP_NS : SCRUB_STEP_NS, time_ns);
+                } else if (len > 0 && (key[0] == 'b' || key[0] == 'B')) {
+                    push_input(CMD_PREVIOUS, 0, time_ns);
+                } else if (len > 0 && key[0] >= '1' && key[0] <= '9') {
+                    push_input(CMD_JUMP, key[0] - '1', time_ns);
+                } else if (keysym == XK_KP_Add || (len > 0 && (key[0] == '+' || key[0] == '='))) {
+                    push_input(CMD_ADJUST, ADJUST_STEP_MS, time_ns);
+                } else if (keysym == XK_KP_Subtract || (len > 0 && key[0] == '-')) {
+                    push_input(CMD_ADJUST, -ADJUST_STEP_MS, time_ns);
+                } else if (len > 0 && (key[0] == 'r' || key[0] == 'R')) {
+                    push_input(CMD_INSERT_REST, 0, time_ns);
                 }
                 break;
             }
-            case ClientMessage: {
-                // Handle window close events
-                Atom wm_delete = XInternAtom(display, "WM_DELETE_WINDOW", True);
-                if (event.xclient.message_type == wm_delete) {
-                    return 'q'; // Treat window close as quit
+            case ClientMessage:
+                // Window closed by the window manager
+                if (event.xclient.message_type == wm_protocols &&
+                    (Atom)event.xclient.data.l[0] == wm_delete_window) {
+                    push_input(CMD_QUIT, 0, monotonic_ns());
                 }
                 break;
-            }
             case ConfigureNotify:
                 // Handle window resize events
                 break;
             case Expose:
-                // Handle window expose events
+                // Window contents were lost, have the renderer repaint them
+                request_full_redraw();
                 break;
         }
     }
-    
-    return 0; // No key pressed
+}
+
+void push_input(int command, int64_t arg, int64_t time_ns) {
+    if (input_queue.count == INPUT_QUEUE_SIZE) {
+        stats.input_dropped++;
+        return;
+    }
+    InputEvent *event = &input_queue.events[(input_queue.head + input_queue.count) % INPUT_QUEUE_SIZE];
+    event->command = command;
+    event->arg = arg;
+    event->time_ns = time_ns;
+    input_queue.count++;
+}
+
+int next_input(InputEvent *event) {
+    if (input_queue.count == 0) return 0;
+    *event = input_queue.events[input_queue.head];
+    input_queue.head = (input_queue.head + 1) % INPUT_QUEUE_SIZE;
+    input_queue.count--;
+    return 1;
+}
+
+void input_not_before(int64_t time_ns) {
+    for (int i = 0; i < input_queue.count; i++) {
+        InputEvent *event = &input_queue.events[(input_queue.head + i) % INPUT_QUEUE_SIZE];
+        if (event->time_ns < time_ns) event->time_ns = time_ns;
+    }
+}
+
+int input_queued(int command) {
+    for (int i = 0; i < input_queue.count; i++) {
+        if (input_queue.events[(input_queue.head + i) % INPUT_QUEUE_SIZE].command == command) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int64_t key_event_ns(Time server_ms) {
+    // The server stamps events in milliseconds. Xorg uses the monotonic
+    // clock, so a gap under a second (modulo the 32-bit wrap) means both
+    // clocks agree and the delay can be read off directly.
+    int64_t received = monotonic_ns();
+    uint32_t gap_ms = (uint32_t)(received / NSEC_PER_MSEC) - (uint32_t)server_ms;
+    if (gap_ms < 1000) {
+        int64_t pressed = (received / NSEC_PER_MSEC - gap_ms) * NSEC_PER_MSEC;
+        record_latency(&stats.key_delivery, received - pressed);
+        return pressed;
+    }
+
+    // Otherwise the smallest gap seen so far is the one with the least
+    // delivery delay, so it maps server time onto ours; a big jump means
+    // the clocks aren't related after all, so start over. A key that sets
+    // the calibration would always read zero, so it isn't recorded.
+    int64_t offset = received - (int64_t)server_ms * NSEC_PER_MSEC;
+    if (!stats.key_clock_calibrated || offset < stats.key_clock_offset ||
+        offset - stats.key_clock_offset > 10 * NSEC_PER_SEC) {
+        stats.key_clock_offset = offset;
+        stats.key_clock_calibrated = 1;
+        return received;
+    }
+    int64_t pressed = (int64_t)server_ms * NSEC_PER_MSEC + stats.key_clock_offset;
+    record_latency(&stats.key_delivery, received - pressed);
+    return pressed;
+}
+
+void record_latency(LatencyHistogram *histogram, int64_t latency_ns) {
+    double us = latency_ns / 1000.0;
+    if (us < 0) us = 0;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= LATENCY_BASE_US * (1 << bucket)) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum_us += us;
+    if (us > histogram->max_us) histogram->max_us = us;
+}
+
+void print_latency(const char *name, const LatencyHistogram *histogram) {
+    if (histogram->count == 0) return;
+
+    printf("  %s: %.2f ms mean, %.2f ms max over %ld keys\n", name,
+           histogram->sum_us / histogram->count / 1000.0, histogram->max_us / 1000.0, histogram->count);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (histogram->buckets[i] == 0) continue;
+        double bound_ms = LATENCY_BASE_US * (1 << i) / 1000.0;
+        if (i < LATENCY_BUCKETS - 1) {
+            printf("    < %8.2f ms  %6ld\n", bound_ms, histogram->buckets[i]);
+        } else {
+            printf("    >= %7.2f ms  %6ld\n", bound_ms / 2, histogram->buckets[i]);
+        }
+    }
+}
+
+void wait_for_events(int64_t deadline_ns) {
+    if (!display) return;
+
+    // Events may already be queued inside Xlib where poll() can't see them
+    XFlush(display);
+    if (XPending(display)) return;
+
+    // A follower also wakes to poll its sync leader, and scrapes that
+    // stall are cut off on time
+    int64_t wake_ns = deadline_ns;
+    if (clock_sync.started && clock_sync.next_poll_ns < wake_ns) wake_ns = clock_sync.next_poll_ns;
+    if (metrics_server.started && metrics_deadline_ns() < wake_ns) wake_ns = metrics_deadline_ns();
+    int64_t timeout_ns = wake_ns - monotonic_ns();
+    if (timeout_ns < 0) timeout_ns = 0;
+
+    // The X connection, then the control socket and its clients, then
+    // the metrics listener and any scrapes in progress, then sync
+    struct pollfd pfds[4 + CONTROL_MAX_CLIENTS + METRICS_MAX_CONNECTIONS];
+    pfds[0].fd = ConnectionNumber(display);
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    int count = 1;
+    if (control.started) {
+        flush_control();
+        count += control_poll_fds(&pfds[1]);
+    }
+    int metrics_first = count;
+    if (metrics_server.started) {
+        count += metrics_poll_fds(&pfds[metrics_first]);
+    }
+    int sync_index = count;
+    if (clock_sync.started) {
+        pfds[count].fd = clock_sync.fd;
+        pfds[count].events = POLLIN;
+        pfds[count].revents = 0;
+        count++;
+    }
+
+    // No deadline at all while paused; only input ends the wait
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ns / NSEC_PER_SEC;
+    timeout.tv_nsec = timeout_ns % NSEC_PER_SEC;
+    if (ppoll(pfds, count, wake_ns == INT64_MAX ? NULL : &timeout, NULL) == 0 && timeout_ns > 0) {
+        record_timer_lateness(wake_ns);
+    }
+    stats.wakeups++;
+    metric_add(&thread_metrics[THREAD_TIMER].wakeups, 1);
+    if (control.started) {
+        service_control(&pfds[1], metrics_first - 1);
+    }
+    if (metrics_server.started) {
+        service_metrics(&pfds[metrics_first], sync_index - metrics_first);
+    }
+    if (clock_sync.started) {
+        service_sync(&pfds[sync_index]);
+    }
+}
+
+void record_timer_lateness(int64_t deadline_ns) {
+    int64_t late_ns = monotonic_ns() - deadline_ns;
+    if (late_ns < 0) late_ns = 0;
+    metric_observe(&thread_metrics[THREAD_TIMER].tick_lateness, late_ns);
+    double late_us = late_ns / 1000.0;
+    stats.timer_waits++;
+    stats.timer_late_sum_us += late_us;
+    if (late_us > stats.timer_late_max_us) stats.timer_late_max_us = late_us;
+}
+
+void setup_realtime() {
+    // Keep freed memory in the heap, so later allocations don't fault in
+    // fresh pages, then pin everything we have and will map
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        printf("Warning: Cannot lock memory (%s), pages may still be swapped or faulted in\n",
+               strerror(errno));
+    }
+    prefault_stack();
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = TIMER_RT_PRIORITY;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+        printf("Warning: Cannot use real-time scheduling (%s); needs CAP_SYS_NICE or an rtprio limit\n",
+               strerror(err));
+    }
+}
+
+void prefault_stack() {
+    // Touch the stack we'll use, so the first deep call doesn't page fault
+    volatile unsigned char buf[REALTIME_PREFAULT_BYTES];
+    memset((unsigned char *)buf, 0, sizeof(buf));
+}
+
+int start_thread(pthread_t *thread, void *(*start)(void *), int priority, const char *name) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (realtime) {
+        // Small stacks, since every page of them is locked. Scheduling is
+        // set explicitly so helper threads don't inherit the timer's priority.
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        pthread_attr_setstacksize(&attr, REALTIME_STACK_BYTES);
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, priority > 0 ? SCHED_FIFO : SCHED_OTHER);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    int err = pthread_create(thread, &attr, start, NULL);
+    if (err == EPERM && realtime && priority > 0) {
+        printf("Warning: No permission for a real-time %s thread, running it normally\n", name);
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+        pthread_attr_setschedparam(&attr, &param);
+        err = pthread_create(thread, &attr, start, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+int64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
 } 
\ No newline at end of file